@@ -0,0 +1,45 @@
+/*
+
+   Copyright (c) 2006-2010, The Scripps Research Institute
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+   Author: Dr. Oleg Trott <ot14@columbia.edu>,
+           The Olson Lab,
+           The Scripps Research Institute
+
+*/
+
+#include <cstdlib> // malloc
+#include <new> // bad_alloc
+#include "allocations.h"
+
+boost::atomic<bool> counting_allocations(false);
+boost::atomic<sz> num_allocations(0);
+
+// The replacements are in a file of their own, so that they are not inlined next to the new
+// expressions whose memory they free (the compiler would take free for a mismatched deallocation).
+// The array and nothrow forms call these.
+
+void* operator new(std::size_t size) throw(std::bad_alloc) {
+    if(counting_allocations.load(boost::memory_order_relaxed))
+        num_allocations.fetch_add(1, boost::memory_order_relaxed);
+    void* tmp = std::malloc(size == 0 ? 1 : size);
+    if(!tmp)
+        throw std::bad_alloc();
+    return tmp;
+}
+
+void operator delete(void* p) throw() {
+    std::free(p);
+}
@@ -0,0 +1,34 @@
+/*
+
+   Copyright (c) 2006-2010, The Scripps Research Institute
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+   Author: Dr. Oleg Trott <ot14@columbia.edu>,
+           The Olson Lab,
+           The Scripps Research Institute
+
+*/
+
+#ifndef VINA_ALLOCATIONS_H
+#define VINA_ALLOCATIONS_H
+
+#include <boost/atomic.hpp>
+#include "common.h"
+
+// The calls of the global operator new, on any thread, while counting_allocations is set.
+// vina_benchmark replaces operator new and delete to count them, see allocations.cpp; vina does not
+extern boost::atomic<bool> counting_allocations;
+extern boost::atomic<sz> num_allocations;
+
+#endif
@@ -0,0 +1,452 @@
+/*
+
+   Copyright (c) 2006-2010, The Scripps Research Institute
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+   Author: Dr. Oleg Trott <ot14@columbia.edu>,
+           The Olson Lab,
+           The Scripps Research Institute
+
+*/
+
+// vina_benchmark: measurements of the parts of the docking of one ligand, on the receptor,
+// ligand and search space of a vina run: the precision of single precision grids, the grid
+// and pair table lookups, the local optimizers, and the heap allocations (see allocations.h,
+// which is why these are not in vina).
+
+#include <iostream>
+#include <string>
+#include <exception>
+#include <vector>
+#include <cmath> // ceil
+#include <algorithm> // nth_element
+#include <boost/program_options.hpp>
+#include <boost/filesystem/exception.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp> // for time in microseconds
+
+#include "parse_pdbqt.h"
+#include "parse_error.h"
+#include "file.h"
+#include "cache.h"
+#include "everything.h"
+#include "weighted_terms.h"
+#include "monte_carlo.h"
+#include "quasi_newton.h"
+#include "coords.h"
+#include "tee.h"
+#include "allocations.h"
+
+using boost::filesystem::path;
+using namespace boost::posix_time;
+
+path make_path(const std::string& str) {
+    return path(str);
+}
+
+struct usage_error : public std::runtime_error {
+    usage_error(const std::string& message) : std::runtime_error(message) {}
+};
+
+const fl grid_slope = 1e6; // as vina
+
+// the settings of the Monte Carlo chains of vina for m, see make_parallel_mc
+monte_carlo vina_monte_carlo(const model& m, sz lbfgs_history) {
+    monte_carlo mc;
+    mc.ssd_par.evals = unsigned((25 + m.num_movable_atoms()) / 3);
+    mc.lbfgs_history = lbfgs_history;
+    mc.min_rmsd = 1.0;
+    mc.num_saved_mins = 20;
+    mc.hunt_cap = vec(10, 10, 10);
+    return mc;
+}
+
+// num_placements random placements of the ligands of m in the search space; the same for the same seed
+std::vector<conf> random_placements(const model& m, const vec& corner1, const vec& corner2, sz num_placements, int seed) {
+    rng generator(static_cast<rng::result_type>(seed));
+    std::vector<conf> tmp;
+    VINA_FOR(i, num_placements) {
+        conf x = m.get_initial_conf();
+        x.randomize(corner1, corner2, generator);
+        tmp.push_back(x);
+    }
+    return tmp;
+}
+
+// The shortest of the times between start and stop, in microseconds: the work is timed over
+// several rounds, and the longer ones include noise from the rest of the machine
+struct best_time {
+    fl best;
+    best_time() : best(max_fl) {}
+    void start() {
+        started = microsec_clock::local_time();
+    }
+    void stop() {
+        const time_duration duration(microsec_clock::local_time() - started);
+        best = (std::min)(best, fl(duration.total_microseconds()));
+    }
+private:
+    ptime started;
+};
+
+void grid_precision_report(const model& m, const cache& c, const cache& reference,
+                           const vec& corner1, const vec& corner2, int seed, tee& log) {
+    rng generator(static_cast<rng::result_type>(seed));
+    const grid_deviation d = c.deviation(reference, m, corner1, corner2, 1000, generator);
+    log << "Single precision grids, deviation from double precision over " << d.num_samples << " random placements:\n";
+    log << std::setprecision(6);
+    log << "    intermolecular energy, all placements  : mean " << d.mean_de << ", max " << d.max_de << '\n';
+    log << "    intermolecular energy, " << d.num_negative << " below zero : mean " << d.mean_de_negative << ", max " << d.max_de_negative << '\n';
+    log << "    per-atom force                         : rms  " << d.rms_df << ", max " << d.max_df;
+    log.endl();
+}
+
+// Times precalculate::eval_deriv at random distances over the type pairs in use,
+// with the full tables and with compact ones.
+void benchmark_tables(const model& m, const precalculate& prec, fl compact_table_factor, int seed, tee& log) {
+    const sz num_lookups = 1000000;
+    const sz num_rounds = 5;
+    rng generator(static_cast<rng::result_type>(seed));
+    const szv pairs = m.get_type_pairs(prec);
+    VINA_CHECK(!pairs.empty());
+    precalculate compact(prec);
+    compact.compact(pairs, compact_table_factor);
+    szv type_pair_indexes(num_lookups);
+    flv r2s(num_lookups);
+    VINA_FOR(i, num_lookups) {
+        type_pair_indexes[i] = pairs[random_sz(0, pairs.size() - 1, generator)];
+        r2s[i] = random_fl(0, prec.cutoff_sqr(), generator);
+    }
+    const precalculate* tables[2] = { &prec, &compact };
+    const char* names[2] = { "full   ", "compact" };
+    const sz bytes[2] = { prec.table_bytes(pairs.size()), compact.compact_bytes() };
+    best_time times[2];
+    fl sums[2] = { 0, 0 };
+    VINA_FOR(round, num_rounds)
+    VINA_FOR(l, 2) {
+        fl sum = 0;
+        times[l].start();
+        VINA_FOR(i, num_lookups) {
+            const pr e_dor = tables[l]->eval_deriv(type_pair_indexes[i], r2s[i]);
+            sum += e_dor.first + e_dor.second;
+        }
+        times[l].stop();
+        sums[l] = sum; // keeps the lookups from being optimized away
+    }
+    fl max_de = 0, max_ddor = 0;
+    VINA_FOR(i, num_lookups) {
+        const pr full = prec.eval_deriv(type_pair_indexes[i], r2s[i]);
+        const pr compacted = compact.eval_deriv(type_pair_indexes[i], r2s[i]);
+        max_de = (std::max)(max_de, std::abs(full.first - compacted.first));
+        max_ddor = (std::max)(max_ddor, std::abs(full.second - compacted.second));
+    }
+    log << "Pair table lookups over the " << pairs.size() << " type pairs in use, best of " << num_rounds << " rounds:\n";
+    log << std::setprecision(3);
+    VINA_FOR(l, 2)
+    log << "    " << names[l] << " : " << bytes[l] / 1024 << " KB of tables, " << times[l].best * 1000 / num_lookups << " ns per lookup (checksum " << sums[l] << ")\n";
+    log << "    compact table factor " << compact_table_factor << ", max deviation: energy " << max_de << ", dor " << max_ddor;
+    log.endl();
+}
+
+// Times the grid lookups of the ligand atoms over random placements in the box,
+// with the grids as populated and with their voxel corners interleaved.
+void benchmark_grid_layout(const model& m, const cache& c, const vec& corner1, const vec& corner2, int seed, tee& log) {
+    const sz num_placements = 1000;
+    const sz num_repeats = 20;
+    const sz num_rounds = 5;
+    const fl v = 1000; // as authentic_v in do_search
+    const std::vector<conf> placements = random_placements(m, corner1, corner2, num_placements, seed);
+    model tmp = m;
+    szv types;
+    soa_vecv coords;
+    VINA_FOR_IN(i, placements) {
+        tmp.set(placements[i]);
+        VINA_FOR(j, tmp.num_movable_atoms()) {
+            types.push_back(tmp.movable_atom(j).get(atom_type::XS));
+            coords.push_back(tmp.movable_coords(j));
+        }
+    }
+    cache interleaved(c);
+    interleaved.interleave();
+    const cache* layouts[2] = { &c, &interleaved };
+    const char* names[2] = { "as populated", "interleaved " };
+    fl energies[2] = { 0, 0 };
+    best_time times[2];
+    soa_vecv minus_forces;
+    minus_forces.resize(coords.size());
+    VINA_FOR(round, num_rounds)
+    VINA_FOR(l, 2) {
+        energies[l] = 0;
+        times[l].start();
+        VINA_FOR(r, num_repeats)
+        energies[l] += layouts[l]->eval_deriv(types, coords, v, minus_forces);
+        times[l].stop();
+    }
+    log << "Grid lookups of " << coords.size() << " atoms (" << num_placements << " random placements), best of " << num_rounds << " rounds:\n";
+    VINA_FOR(l, 2)
+    log << "    " << names[l] << " : " << std::setprecision(3) << times[l].best * 1000 / (num_repeats * coords.size()) << " ns per atom\n";
+    log << "    energies are " << ((energies[0] == energies[1]) ? "identical" : "different");
+    log.endl();
+}
+
+void benchmark_optimizers(const model& m, const precalculate& prec, const igrid& ig, const vec& corner1, const vec& corner2, unsigned max_steps, sz lbfgs_history, int seed, tee& log) {
+    const sz num_placements = 200;
+    const sz num_rounds = 3;
+    const monte_carlo mc; // for hunt_cap
+    const std::vector<conf> placements = random_placements(m, corner1, corner2, num_placements, seed);
+    model tmp = m;
+    quasi_newton optimizers[2];
+    const char* names[2] = { "bfgs ", "lbfgs" };
+    optimizers[1].lbfgs_history = lbfgs_history;
+    best_time times[2]; // of num_placements local optimizations
+    fl energies[2] = { 0, 0 }; // median
+    VINA_FOR(l, 2) {
+        optimizers[l].max_steps = max_steps;
+        VINA_FOR(round, num_rounds) {
+            change g(m.get_size());
+            flv e;
+            times[l].start();
+            VINA_FOR(i, num_placements) {
+                tmp.tried = visited(); // each optimization runs to the end
+                output_type out(placements[i], 0);
+                optimizers[l](tmp, prec, ig, out, g, mc.hunt_cap);
+                e.push_back(out.e);
+            }
+            times[l].stop();
+            std::nth_element(e.begin(), e.begin() + num_placements / 2, e.end());
+            energies[l] = e[num_placements / 2];
+        }
+    }
+    log << "Local optimizations of " << num_placements << " random placements with " << m.get_size().num_degrees_of_freedom()
+        << " degrees of freedom, at most " << max_steps << " steps, best of " << num_rounds << " rounds:\n";
+    VINA_FOR(l, 2)
+    log << "    " << names[l] << " : " << std::setprecision(3) << times[l].best / num_placements << " us per optimization, median energy " << energies[l] << '\n';
+    log << "    (lbfgs keeps " << lbfgs_history << " steps)";
+    log.endl();
+}
+
+void allocation_report(const model& m, const precalculate& prec, const igrid& ig, const vec& corner1, const vec& corner2, const monte_carlo& mc, int seed, tee& log) {
+    const sz num_placements = 100;
+    const unsigned num_steps = 500; // of the Monte Carlo chains
+    const std::vector<conf> placements = random_placements(m, corner1, corner2, num_placements, seed);
+    model tmp = m;
+    change g(m.get_size());
+    quasi_newton optimizer;
+    optimizer.max_steps = mc.ssd_par.evals;
+    optimizer.lbfgs_history = mc.lbfgs_history;
+    quasi_newton_workspace workspace(optimizer.workspace(placements.front(), g));
+    VINA_FOR(i, num_placements) { // fills the visited history of tmp
+        output_type out(placements[i], 0);
+        optimizer(tmp, prec, ig, out, g, mc.hunt_cap, workspace);
+    }
+
+    sz optimizations[2]; // with their own temporaries, with the workspace
+    VINA_FOR(w, 2) {
+        std::vector<output_type> outs;
+        VINA_FOR(i, num_placements)
+        outs.push_back(output_type(placements[i], 0));
+        num_allocations = 0;
+        counting_allocations = true;
+        VINA_FOR(i, num_placements) {
+            if(w == 0)
+                optimizer(tmp, prec, ig, outs[i], g, mc.hunt_cap);
+            else
+                optimizer(tmp, prec, ig, outs[i], g, mc.hunt_cap, workspace);
+        }
+        counting_allocations = false;
+        optimizations[w] = num_allocations;
+    }
+
+    sz chains[2]; // of num_steps and 2 * num_steps steps, from the same seed, so that their first num_steps steps are the same
+    VINA_FOR(c, 2) {
+        monte_carlo chain = mc;
+        chain.num_steps = (c + 1) * num_steps;
+        rng chain_generator(static_cast<rng::result_type>(seed));
+        output_container out;
+        tmp.tried = visited();
+        num_allocations = 0;
+        counting_allocations = true;
+        chain(tmp, out, prec, ig, prec, ig, corner1, corner2, NULL, chain_generator);
+        counting_allocations = false;
+        chains[c] = num_allocations;
+    }
+
+    log << "Heap allocations per local optimization from a random placement: " << std::setprecision(3)
+        << fl(optimizations[0]) / num_placements << " with its own temporaries, " << fl(optimizations[1]) / num_placements << " with a workspace\n";
+    log << "Heap allocations of a Monte Carlo chain: " << chains[0] << " in the first " << num_steps << " steps (setup, visited history and saved modes), "
+        << (chains[1] - chains[0]) << " in the next " << num_steps;
+    log.endl();
+}
+
+int main(int argc, char* argv[]) {
+    using namespace boost::program_options;
+    const std::string error_message = "\n\nPlease report this problem with the command line options and the inputs.\n";
+
+    try {
+        std::string rigid_name, flex_name, ligand_name, local_optimizer = "bfgs";
+        fl center_x, center_y, center_z, size_x, size_y, size_z;
+        int cpu = 1, seed = 0, lbfgs_history = 8;
+        fl compact_table_factor = 32;
+        bool precision_report = false, layout_benchmark = false, table_benchmark = false, optimizer_benchmark = false, report_allocations = false, help = false;
+
+        options_description inputs("Input, as for vina");
+        inputs.add_options()
+        ("receptor", value<std::string>(&rigid_name), "rigid part of the receptor (PDBQT)")
+        ("flex", value<std::string>(&flex_name), "flexible side chains, if any (PDBQT)")
+        ("ligand", value<std::string>(&ligand_name), "ligand (PDBQT)")
+        ("center_x", value<fl>(&center_x), "X coordinate of the center")
+        ("center_y", value<fl>(&center_y), "Y coordinate of the center")
+        ("center_z", value<fl>(&center_z), "Z coordinate of the center")
+        ("size_x", value<fl>(&size_x), "size in the X dimension (Angstroms)")
+        ("size_y", value<fl>(&size_y), "size in the Y dimension (Angstroms)")
+        ("size_z", value<fl>(&size_z), "size in the Z dimension (Angstroms)")
+        ("cpu", value<int>(&cpu)->default_value(cpu), "the number of CPUs that compute the grids")
+        ("seed", value<int>(&seed)->default_value(seed), "random seed of the placements")
+        ("local_optimizer", value<std::string>(&local_optimizer)->default_value(local_optimizer), "bfgs or lbfgs, for allocation_report")
+        ("lbfgs_history", value<int>(&lbfgs_history)->default_value(lbfgs_history), "number of steps lbfgs keeps")
+        ("compact_table_factor", value<fl>(&compact_table_factor)->default_value(compact_table_factor), "samples per squared Angstrom in the compact tables")
+        ;
+        options_description measurements("Measurements");
+        measurements.add_options()
+        ("grid_precision_report", bool_switch(&precision_report), "report the energy deviation of single precision grids from double precision ones")
+        ("grid_layout_benchmark", bool_switch(&layout_benchmark), "time grid lookups with and without interleaved voxel corners")
+        ("table_benchmark", bool_switch(&table_benchmark), "time pair table lookups with the full and the compact tables")
+        ("optimizer_benchmark", bool_switch(&optimizer_benchmark), "time local optimizations from random placements with bfgs and lbfgs")
+        ("allocation_report", bool_switch(&report_allocations), "count the heap allocations of local optimizations and of a short Monte Carlo chain")
+        ;
+        options_description info("Information (optional)");
+        info.add_options()
+        ("help", bool_switch(&help), "print this message")
+        ;
+        options_description desc;
+        desc.add(inputs).add(measurements).add(info);
+
+        positional_options_description positional; // remains empty
+        variables_map vm;
+        try {
+            store(command_line_parser(argc, argv)
+                  .options(desc)
+                  .style(command_line_style::default_style ^ command_line_style::allow_guessing)
+                  .positional(positional)
+                  .run(),
+                  vm);
+            notify(vm);
+        }
+        catch(boost::program_options::error& e) {
+            std::cerr << "Command line parse error: " << e.what() << '\n' << "\nCorrect usage:\n" << desc << '\n';
+            return 1;
+        }
+        if(help) {
+            std::cout << desc << '\n';
+            return 0;
+        }
+        const char* required[] = { "receptor", "ligand", "center_x", "center_y", "center_z", "size_x", "size_y", "size_z" };
+        VINA_FOR(i, sizeof(required) / sizeof(required[0]))
+        if(vm.count(required[i]) == 0) {
+            std::cerr << "Missing " << required[i] << ".\n" << "\nCorrect usage:\n" << desc << '\n';
+            return 1;
+        }
+        if(size_x <= 0 || size_y <= 0 || size_z <= 0)
+            throw usage_error("Search space dimensions should be positive");
+        if(cpu < 1)
+            cpu = 1;
+        if(local_optimizer != "bfgs" && local_optimizer != "lbfgs")
+            throw usage_error("local_optimizer must be bfgs or lbfgs");
+        if(lbfgs_history < 1)
+            throw usage_error("lbfgs_history must be 1 or greater");
+        if(compact_table_factor <= 0)
+            throw usage_error("compact_table_factor must be positive");
+
+        model m = vm.count("flex") ? parse_receptor_pdbqt(make_path(rigid_name), make_path(flex_name))
+                  : parse_receptor_pdbqt(make_path(rigid_name));
+        m.append(parse_ligand_pdbqt(make_path(ligand_name)));
+
+        grid_dims gd; // as vina
+        const fl granularity = 0.375;
+        const vec span(size_x, size_y, size_z);
+        const vec center(center_x, center_y, center_z);
+        VINA_FOR_IN(i, gd) {
+            gd[i].n = sz(std::ceil(span[i] / granularity));
+            fl real_span = granularity * gd[i].n;
+            gd[i].begin = center[i] - real_span/2;
+            gd[i].end = gd[i].begin + real_span;
+        }
+        const vec corner1(gd[0].begin, gd[1].begin, gd[2].begin);
+        const vec corner2(gd[0].end,   gd[1].end,   gd[2].end);
+
+        flv weights; // the defaults of vina
+        weights.push_back(-0.035579);
+        weights.push_back(-0.005156);
+        weights.push_back(0.840245);
+        weights.push_back(-0.035069);
+        weights.push_back(-0.587439);
+        weights.push_back(5 * 0.05846 / 0.1 - 1);
+        everything t;
+        weighted_terms wt(&t, weights);
+        precalculate prec(wt);
+
+        tee log;
+        cache c("scoring_function_version001", gd, grid_slope, atom_type::XS);
+        c.populate(m, prec, m.get_movable_atom_types(prec.atom_typing_used()), true, cpu);
+
+        const monte_carlo mc = vina_monte_carlo(m, (local_optimizer == "lbfgs") ? sz(lbfgs_history) : 0);
+        if(precision_report) {
+            cache single("scoring_function_version001", gd, grid_slope, atom_type::XS, true);
+            single.populate(m, prec, m.get_movable_atom_types(prec.atom_typing_used()), true, cpu);
+            grid_precision_report(m, single, c, corner1, corner2, seed, log);
+        }
+        if(layout_benchmark)
+            benchmark_grid_layout(m, c, corner1, corner2, seed, log);
+        if(table_benchmark)
+            benchmark_tables(m, prec, compact_table_factor, seed, log);
+        if(optimizer_benchmark)
+            benchmark_optimizers(m, prec, c, corner1, corner2, mc.ssd_par.evals, sz(lbfgs_history), seed, log);
+        if(report_allocations)
+            allocation_report(m, prec, c, corner1, corner2, mc, seed, log);
+    }
+    catch(file_error& e) {
+        std::cerr << "\n\nError: could not open \"" << e.name.string() << "\" for " << (e.in ? "reading" : "writing") << ".\n";
+        return 1;
+    }
+    catch(boost::filesystem::filesystem_error& e) {
+        std::cerr << "\n\nFile system error: " << e.what() << '\n';
+        return 1;
+    }
+    catch(usage_error& e) {
+        std::cerr << "\n\nUsage error: " << e.what() << ".\n";
+        return 1;
+    }
+    catch(parse_error& e) {
+        std::cerr << "\n\nParse error on line " << e.line << " in file \"" << e.file.string() << "\": " << e.reason << '\n';
+        return 1;
+    }
+    catch(std::bad_alloc&) {
+        std::cerr << "\n\nError: insufficient memory!\n";
+        return 1;
+    }
+
+    // Errors that shouldn't happen:
+
+    catch(std::exception& e) {
+        std::cerr << "\n\nAn error occurred: " << e.what() << ". " << error_message;
+        return 1;
+    }
+    catch(internal_error& e) {
+        std::cerr << "\n\nAn internal error occurred in " << e.file << "(" << e.line << "). " << error_message;
+        return 1;
+    }
+    catch(...) {
+        std::cerr << "\n\nAn unknown error occurred. " << error_message;
+        return 1;
+    }
+}
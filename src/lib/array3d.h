@@ -42,6 +42,7 @@ template<typename T>
 class array3d {
     sz m_i, m_j, m_k;
     std::vector<T> m_data;
+    const T* m_view; // NULL, unless the values live in memory owned by someone else (see view)
     friend class boost::serialization::access;
     template<typename Archive>
     void serialize(Archive& ar, const unsigned version) {
@@ -51,8 +52,8 @@ class array3d {
         ar & m_data;
     }
 public:
-    array3d() : m_i(0), m_j(0), m_k(0) {}
-    array3d(sz i, sz j, sz k) : m_i(i), m_j(j), m_k(k), m_data(checked_multiply(i, j, k)) {}
+    array3d() : m_i(0), m_j(0), m_k(0), m_view(NULL) {}
+    array3d(sz i, sz j, sz k) : m_i(i), m_j(j), m_k(k), m_data(checked_multiply(i, j, k)), m_view(NULL) {}
     sz dim0() const {
         return m_i;
     }
@@ -80,12 +81,35 @@ public:
         m_j = j;
         m_k = k;
         m_data.resize(checked_multiply(i, j, k));
+        m_view = NULL;
+    }
+    void view(sz i, sz j, sz k, const T* external) { // read-only, does not copy; external must outlive this
+        m_i = i;
+        m_j = j;
+        m_k = k;
+        std::vector<T>().swap(m_data);
+        m_view = external;
+    }
+    void clear() { // releases the memory
+        m_i = m_j = m_k = 0;
+        std::vector<T>().swap(m_data);
+        m_view = NULL;
+    }
+    bool is_view() const {
+        return m_view != NULL;
+    }
+    sz size() const {
+        return m_i * m_j * m_k;
+    }
+    const T* data() const { // the values in (i, j, k) order, i fastest
+        return m_view ? m_view : (m_data.empty() ? NULL : &m_data[0]);
     }
     T&       operator()(sz i, sz j, sz k)       {
+        assert(!m_view);
         return m_data[i + m_i*(j + m_j*k)];
     }
     const T& operator()(sz i, sz j, sz k) const {
-        return m_data[i + m_i*(j + m_j*k)];
+        return (m_view ? m_view : &m_data[0])[i + m_i*(j + m_j*k)];
     }
 };
 
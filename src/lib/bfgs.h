@@ -49,10 +49,9 @@ inline fl scalar_product(const Change& a, const Change& b, sz n) {
 }
 
 template<typename Change>
-inline bool bfgs_update(flmat& h, const Change& p, const Change& y, const fl alpha) {
+inline bool bfgs_update(flmat& h, const Change& p, const Change& y, const fl alpha, Change& minus_hy) { // minus_hy is scratch of the size of y
     const fl yp  = scalar_product(y, p, h.dim());
     if(alpha * yp < epsilon_fl) return false; // FIXME?
-    Change minus_hy(y);
     minus_mat_vec_product(h, y, minus_hy);
     const fl yhy = - scalar_product(y, minus_hy, h.dim());
     const fl r = 1 / (alpha * yp); // 1 / (s^T * y) , where s = alpha * p // FIXME   ... < epsilon
@@ -90,12 +89,115 @@ inline void set_diagonal(flmat& m, fl x) {
     m(i, i) = x;
 }
 
+inline void set_identity(flmat& m) { // as flmat(n, 0) followed by set_diagonal(m, 1), without allocating
+    VINA_FOR(i, m.dim())
+    VINA_RANGE(j, i, m.dim()) // includes i
+    m(i, j) = (i == j) ? 1 : 0;
+}
+
 template<typename Change>
 void subtract_change(Change& b, const Change& a, sz n) { // b -= a
     VINA_FOR(i, n)
     b(i) -= a(i);
 }
 
+// Limited memory BFGS: instead of the dense h, the last (at most) history steps
+// s = alpha * p and gradient changes y are kept, each as a row of n floats, and
+// the product with h is computed from them by the two loop recursion, which is
+// O(history * n) per step instead of the O(n^2) of minus_mat_vec_product and
+// bfgs_update.
+struct lbfgs_history {
+    sz n;
+    sz capacity;
+    sz count; // of the stored pairs
+    sz next; // row for the next pair
+    flv s;
+    flv y;
+    flv rho; // 1 / (s^T * y) of each row
+    flv a; // scratch for direction
+    flv q; // likewise
+    fl gamma; // scales the initial h, as set_diagonal in bfgs
+
+    lbfgs_history(sz n_, sz capacity_) : n(n_), capacity(capacity_), count(0), next(0), s(n_ * capacity_), y(n_ * capacity_), rho(capacity_), a(capacity_), q(n_), gamma(1) {}
+    static fl dot(const fl* u, const fl* v, sz n) {
+        fl tmp = 0;
+        VINA_FOR(i, n)
+        tmp += u[i] * v[i];
+        return tmp;
+    }
+    template<typename Change>
+    void direction(const Change& g, Change& p) { // p = - h * g
+        VINA_FOR(i, n)
+        q[i] = g(i);
+        VINA_FOR(k, count) { // newest first
+            const sz r = (next + capacity - 1 - k) % capacity;
+            const fl* sr = &s[r * n];
+            const fl* yr = &y[r * n];
+            a[r] = rho[r] * dot(sr, &q[0], n);
+            VINA_FOR(i, n)
+            q[i] -= a[r] * yr[i];
+        }
+        VINA_FOR(i, n)
+        q[i] *= gamma;
+        VINA_FOR(k, count) { // oldest first
+            const sz r = (next + capacity - count + k) % capacity;
+            const fl* sr = &s[r * n];
+            const fl* yr = &y[r * n];
+            const fl b = rho[r] * dot(yr, &q[0], n);
+            VINA_FOR(i, n)
+            q[i] += (a[r] - b) * sr[i];
+        }
+        VINA_FOR(i, n)
+        p(i) = -q[i];
+    }
+    void clear() {
+        count = 0;
+        next = 0;
+        gamma = 1;
+    }
+    template<typename Change>
+    void update(const Change& p, const Change& g, const Change& g_new, const fl alpha) { // as bfgs_update
+        fl ys = 0;
+        fl yy = 0;
+        VINA_FOR(i, n) {
+            const fl yi = g_new(i) - g(i);
+            ys += yi * alpha * p(i);
+            yy += yi * yi;
+        }
+        if(ys < epsilon_fl) return; // FIXME? as in bfgs_update
+        fl* sr = &s[next * n]; // written only now, since once full this row holds the oldest pair
+        fl* yr = &y[next * n];
+        VINA_FOR(i, n) {
+            sr[i] = alpha * p(i);
+            yr[i] = g_new(i) - g(i);
+        }
+        if(std::abs(yy) > epsilon_fl)
+            gamma = ys / yy;
+        rho[next] = 1 / ys;
+        next = (next + 1) % capacity;
+        if(count < capacity)
+            ++count;
+    }
+};
+
+// The temporaries of bfgs and lbfgs, made once from x and g and reused by
+// all the local optimizations of the same sizes, so that these don't allocate
+template<typename Conf, typename Change>
+struct bfgs_workspace {
+    flmat h; // empty for lbfgs
+    lbfgs_history history; // empty for bfgs
+    Change g_new;
+    Change g_orig;
+    Change p;
+    Change y;
+    Change minus_hy;
+    Conf x_new;
+    Conf x_orig;
+    bfgs_workspace(const Conf& x, const Change& g, sz lbfgs_capacity) // lbfgs_capacity is 0 for bfgs
+        : h((lbfgs_capacity > 0) ? 0 : g.num_floats(), 0), history((lbfgs_capacity > 0) ? g.num_floats() : 0, lbfgs_capacity),
+          g_new(g), g_orig(g), p(g), y(g), minus_hy(g), x_new(x), x_orig(x) {}
+};
+
 //the calling function was
 //void quasi_newton::operator()(model& m, const precalculate& p, const igrid& ig, output_type& out, change& g, const vec& v) const { // g must have correct size
 //	quasi_newton_aux aux(&m, &p, &ig, v);
@@ -104,18 +206,18 @@ void subtract_change(Change& b, const Change& a, sz n) { // b -= a
 //}
 //// N.B. y = individual numbers, f = function= y(x), g = delta f = first order derivative
 template<typename F, typename Conf, typename Change>
-fl bfgs(F& f, Conf& x, Change& g, const unsigned max_steps, const fl average_required_improvement, const sz over) { // x is I/O, final value is returned
+fl bfgs(F& f, Conf& x, Change& g, const unsigned max_steps, const fl average_required_improvement, const sz over, bfgs_workspace<Conf, Change>& w) { // x is I/O, final value is returned
 
 //	::print(f.v);printf("\n");
 //	printf("XOUYANG %lf\n",f.v[0]);
     flv outputFlv;//by Amr
 
     sz n = g.num_floats();//
-    flmat h(n, 0);
-    set_diagonal(h, 1);
+    flmat& h = w.h;
+    set_identity(h);
 
-    Change g_new(g);
-    Conf x_new(x);
+    Change& g_new = w.g_new;
+    Conf& x_new = w.x_new;
 
 
     fl f0 = f(x, g); //evaluate the derivative of conf x in change g, and returns the the function value in f0
@@ -131,9 +233,11 @@ fl bfgs(F& f, Conf& x, Change& g, const unsigned max_steps, const fl average_req
 
 
     fl f_orig = f0;
-    Change g_orig(g);
-    Conf x_orig(x);
-    Change p(g);//descent direction
+    Change& g_orig = w.g_orig;
+    g_orig = g;
+    Conf& x_orig = w.x_orig;
+    x_orig = x;
+    Change& p = w.p;//descent direction
 
 //	flv f_values; f_values.reserve(max_steps+1);//TODO what is the use of this vector ???
 //	f_values.push_back(f0);
@@ -142,7 +246,8 @@ fl bfgs(F& f, Conf& x, Change& g, const unsigned max_steps, const fl average_req
         minus_mat_vec_product(h, g, p);//find and fill direction p
         fl f1 = 0;
         const fl alpha = line_search(f, n, x, g, f0, p, x_new, g_new, f1);//find amplitudes of change vector and update from p to f1
-        Change y(g_new);
+        Change& y = w.y;
+        y = g_new;
         subtract_change(y, g, n);//y(k) = del f(x(k+1)) - del f(x(k))
 
 //		printf("%f\t",f1);
@@ -160,7 +265,7 @@ fl bfgs(F& f, Conf& x, Change& g, const unsigned max_steps, const fl average_req
                 set_diagonal(h, alpha * scalar_product(y, p, n) / yy);
         }
 
-        bool h_updated = bfgs_update(h, p, y, alpha);//updates h only
+        bool h_updated = bfgs_update(h, p, y, alpha, w.minus_hy);//updates h only
         f.m->tried.add(x, f0, g);
     }
 
@@ -177,4 +282,54 @@ fl bfgs(F& f, Conf& x, Change& g, const unsigned max_steps, const fl average_req
     return f0;
 }
 
+// bfgs with lbfgs_history instead of the dense h
+template<typename F, typename Conf, typename Change>
+fl lbfgs(F& f, Conf& x, Change& g, const unsigned max_steps, bfgs_workspace<Conf, Change>& w) { // x is I/O, final value is returned
+    sz n = g.num_floats();
+    lbfgs_history& h = w.history;
+    assert(h.n == n && h.capacity > 0);
+    h.clear();
+
+    Change& g_new = w.g_new;
+    Conf& x_new = w.x_new;
+
+    fl f0 = f(x, g);
+
+    if (!(f.m->tried.interesting(x, f0, g))) {
+        return f0;
+    }
+    f.m->tried.add(x, f0, g);
+
+    fl f_orig = f0;
+    Change& g_orig = w.g_orig;
+    g_orig = g;
+    Conf& x_orig = w.x_orig;
+    x_orig = x;
+    Change& p = w.p;//descent direction
+
+    VINA_U_FOR(step, max_steps) {
+        h.direction(g, p);
+        if(!(scalar_product(p, g, n) < 0)) { // not a descent direction, or nans: start over from the gradient
+            h.clear();
+            VINA_FOR(i, n)
+            p(i) = -g(i);
+        }
+        fl f1 = 0;
+        const fl alpha = line_search(f, n, x, g, f0, p, x_new, g_new, f1);
+        h.update(p, g, g_new, alpha);
+        f0 = f1;
+        x = x_new;
+        g = g_new;
+        if(!(std::sqrt(scalar_product(g, g, n)) >= 1e-5)) break; // breaks for nans too
+        f.m->tried.add(x, f0, g);
+    }
+
+    if(!(f0 <= f_orig)) { // succeeds for nans too
+        f0 = f_orig;
+        x = x_orig;
+        g = g_orig;
+    }
+    return f0;
+}
+
 #endif
@@ -21,29 +21,30 @@
 */
 
 #include <algorithm> // fill, etc
+#include <cstring> // memcmp, memcpy
+#include <sys/mman.h> // mprotect
 
-#if 0 // use binary cache
-// for some reason, binary archive gives four huge warnings in VC2008
-#include <boost/archive/binary_oarchive.hpp>
-#include <boost/archive/binary_iarchive.hpp>
-typedef boost::archive::binary_iarchive iarchive;
-typedef boost::archive::binary_oarchive oarchive;
-#else // use text cache
-#include <boost/archive/text_oarchive.hpp>
-#include <boost/archive/text_iarchive.hpp>
-typedef boost::archive::text_iarchive iarchive;
-typedef boost::archive::text_oarchive oarchive;
+#ifdef __AVX2__
+#include <immintrin.h>
 #endif
 
-#include <boost/serialization/split_member.hpp>
-#include <boost/filesystem/fstream.hpp>
-#include <boost/static_assert.hpp>
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/filesystem/operations.hpp> // rename
+#include <boost/interprocess/anonymous_shared_memory.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/scoped_array.hpp>
 #include "cache.h"
 #include "file.h"
+#include "my_pid.h"
+#include "thread_pool.h"
 #include "szv_grid.h"
 
-cache::cache(const std::string& scoring_function_version_, const grid_dims& gd_, fl slope_, atom_type::t atom_typing_used_)
-    : scoring_function_version(scoring_function_version_), gd(gd_), slope(slope_), atu(atom_typing_used_), grids(num_atom_types(atom_typing_used_)) {}
+cache::cache(const std::string& scoring_function_version_, const grid_dims& gd_, fl slope_, atom_type::t atom_typing_used_, bool single_precision_, bool lazy_)
+    : scoring_function_version(scoring_function_version_), gd(gd_), slope(slope_), atu(atom_typing_used_), single_precision(single_precision_), lazy(lazy_), grids(num_atom_types(atom_typing_used_)) {
+    VINA_CHECK(!(single_precision && lazy)); // the bricks are double precision
+}
 
 fl cache::eval      (const model& m, fl v) const { // needs m.coords
     fl e = 0;
@@ -60,113 +61,596 @@ fl cache::eval      (const model& m, fl v) const { // needs m.coords
     return e;
 }
 
+void group_by_type(const model& m, const atomv& atoms, atom_type::t atu, atom_type_groups& groups) {
+    const sz nat = num_atom_types(atu);
+    groups.types.resize(m.num_movable_atoms());
+    VINA_FOR(i, m.num_movable_atoms())
+    groups.types[i] = (std::min)(atoms[i].get(atu), nat);
+    groups.begin.assign(nat + 2, 0);
+    VINA_FOR(i, m.num_movable_atoms())
+    ++groups.begin[groups.types[i] + 1];
+    VINA_FOR(t, nat + 1)
+    groups.begin[t + 1] += groups.begin[t];
+    groups.atoms.resize(m.num_movable_atoms());
+    szv next(groups.begin.begin(), groups.begin.end() - 1);
+    VINA_FOR(i, m.num_movable_atoms())
+    groups.atoms[next[groups.types[i]]++] = i;
+    groups.energies.resize(m.num_movable_atoms());
+}
+
 fl cache::eval_deriv(      model& m, fl v) const { // needs m.coords, sets m.minus_forces
+    sz nat = num_atom_types(atu);
+
+    atom_type_groups& groups = m.movable_groups;
+    if(groups.atoms.size() != m.num_movable_atoms() || groups.begin.size() != nat + 2)
+        group_by_type(m, m.atoms, atu, groups);
+
+    VINA_FOR(t, nat) {
+        const sz begin = groups.begin[t];
+        const sz end = groups.begin[t + 1];
+        if(begin == end) continue;
+        assert(grids[t].initialized());
+        grids[t].evaluate(m.coords, &groups.atoms[begin], end - begin, slope, v, &groups.energies[0], m.minus_forces);
+    }
+    VINA_RANGE(i, groups.begin[nat], groups.begin[nat + 1])
+    m.minus_forces.set(groups.atoms[i], zero_vec);
+
+    fl e = 0;
+    VINA_FOR(i, m.num_movable_atoms()) // in the order of the atoms, as the energies of the atoms were always summed
+    if(groups.types[i] < nat)
+        e += groups.energies[i];
+    return e;
+}
+
+fl cache::eval_deriv(const szv& types, const soa_vecv& coords, fl v, soa_vecv& minus_forces) const {
     fl e = 0;
     sz nat = num_atom_types(atu);
 
-    VINA_FOR(i, m.num_movable_atoms()) {
-        const atom& a = m.atoms[i];
-        sz t = a.get(atu);
+    VINA_FOR(i, coords.size()) {
+        sz t = types[i];
         if(t >= nat) {
-            m.minus_forces[i].assign(0);
+            minus_forces.set(i, zero_vec);
             continue;
         }
         const grid& g = grids[t];
         assert(g.initialized());
         vec deriv;
-        e += g.evaluate(m.coords[i], slope, v, deriv);
-        m.minus_forces[i] = deriv;
+        e += g.evaluate(coords[i], slope, v, deriv);
+        minus_forces.set(i, deriv);
     }
     return e;
 }
 
-#if 0 // No longer doing I/O of the cache
-void cache::read(const path& p) {
-    ifile in(p, std::ios::binary);
-    iarchive ar(in);
-    ar >> *this;
+void cache::interleave() {
+    VINA_FOR_IN(t, grids)
+    if(grids[t].initialized() && !grids[t].interleaved() && !grids[t].lazy())
+        grids[t].make_interleaved();
 }
 
-void cache::write(const path& p) const {
-    ofile out(p, std::ios::binary);
-    oarchive ar(out);
-    ar << *this;
+// Grid file layout: a grid_file_header, then the values of each stored type
+// as written by array3d::data(), each starting on a page boundary so that the
+// grids can be used in place from a read-only mapping of the file.
+
+const char grid_file_magic[8] = {'S', 'V', 'I', 'N', 'A', 'G', 'R', 'D'};
+const boost::uint32_t grid_file_version = 1;
+const boost::uint32_t grid_file_byte_order = 0x01020304;
+const sz grid_file_alignment = 4096;
+const sz grid_file_max_types = 32;
+const sz grid_file_max_weights = 8;
+
+struct grid_file_header {
+    char magic[8];
+    boost::uint32_t version;
+    boost::uint32_t byte_order;
+    boost::uint32_t value_size;
+    boost::uint32_t atom_typing_used;
+    char scoring_function_version[64];
+    boost::uint64_t receptor_hash;
+    double begin[3];
+    double end[3];
+    boost::uint64_t n[3];
+    double granularity[3];
+    boost::uint64_t num_weights;
+    double weights[grid_file_max_weights];
+    boost::uint64_t offsets[grid_file_max_types]; // from the start of the file; 0 if the type is not stored
+};
+
+struct fnv1a_hash { // 64-bit FNV-1a, stable across runs and machines of the same byte order
+    boost::uint64_t value;
+    fnv1a_hash() : value(14695981039346656037ULL) {}
+    void add(const void* data, sz size) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        VINA_FOR(i, size) {
+            value ^= bytes[i];
+            value *= 1099511628211ULL;
+        }
+    }
+    template<typename T>
+    void add(const T& x) {
+        add(&x, sizeof(T));
+    }
+};
+
+boost::uint64_t cache::receptor_hash(const model& m) const {
+    fnv1a_hash h;
+    VINA_FOR_IN(i, m.grid_atoms()) {
+        const atom& a = m.grid_atoms()[i];
+        h.add(boost::uint64_t(a.get(atu)));
+        VINA_FOR(j, 3)
+        h.add(a.coords[j]);
+    }
+    return h.value;
+}
+
+sz grid_file_aligned(sz offset) {
+    return (offset + grid_file_alignment - 1) / grid_file_alignment * grid_file_alignment;
 }
-#endif
 
-template<class Archive>
-void cache::save(Archive& ar, const unsigned version) const {
-    ar & scoring_function_version;
-    ar & gd;
-    ar & atu;
-    ar & grids;
+void fill_header(grid_file_header& h, const std::string& scoring_function_version, boost::uint64_t receptor_hash, const grid_dims& gd, atom_type::t atu, bool single_precision, const flv& weights) {
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, grid_file_magic, sizeof(h.magic));
+    h.version = grid_file_version;
+    h.byte_order = grid_file_byte_order;
+    h.value_size = single_precision ? sizeof(float) : sizeof(fl);
+    h.atom_typing_used = atu;
+    VINA_CHECK(scoring_function_version.size() < sizeof(h.scoring_function_version));
+    std::memcpy(h.scoring_function_version, scoring_function_version.c_str(), scoring_function_version.size() + 1);
+    h.receptor_hash = receptor_hash;
+    VINA_FOR(i, 3) {
+        h.begin[i] = gd[i].begin;
+        h.end[i] = gd[i].end;
+        h.n[i] = gd[i].n;
+        h.granularity[i] = (gd[i].n > 0) ? gd[i].span() / gd[i].n : 0;
+    }
+    VINA_CHECK(weights.size() <= grid_file_max_weights);
+    h.num_weights = weights.size();
+    VINA_FOR_IN(i, weights)
+    h.weights[i] = weights[i];
+}
+
+std::string cache::file_name(const model& m, const flv& weights) const {
+    grid_file_header h;
+    fill_header(h, scoring_function_version, receptor_hash(m), gd, atu, single_precision, weights); // offsets are all 0 here
+    fnv1a_hash key;
+    key.add(&h, sizeof(h));
+    std::ostringstream out;
+    out << "grids_" << std::hex << std::setw(16) << std::setfill('0') << key.value << ".bin";
+    return out.str();
+}
+
+void cache::write(const path& name, const model& m, const flv& weights) const {
+    grid_file_header h;
+    fill_header(h, scoring_function_version, receptor_hash(m), gd, atu, single_precision, weights);
+    VINA_CHECK(grids.size() <= grid_file_max_types);
+    VINA_FOR_IN(t, grids)
+    VINA_CHECK(!grids[t].interleaved());
+    sz offset = grid_file_aligned(sizeof(h));
+    VINA_FOR_IN(t, grids) {
+        if(!grids[t].initialized() || grids[t].lazy()) continue;
+        h.offsets[t] = offset;
+        offset = grid_file_aligned(offset + grids[t].num_bytes());
+    }
+
+    // written under a temporary name and renamed, so that concurrent readers never see a partial file;
+    // the name is unique to this process on this host, as the directory may be shared between nodes
+    const path tmp_name(name.string() + "." + my_host_name() + "." + to_string(my_pid()) + ".tmp");
+    try {
+        ofile out(tmp_name, std::ios::binary);
+        out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+        sz written = sizeof(h);
+        VINA_FOR_IN(t, grids) {
+            if(h.offsets[t] == 0) continue;
+            const std::vector<char> padding(h.offsets[t] - written, 0);
+            if(!padding.empty())
+                out.write(&padding[0], padding.size());
+            const sz size = grids[t].num_bytes();
+            out.write(grids[t].bytes(), size);
+            written = h.offsets[t] + size;
+        }
+        out.close(); // before the rename, and so that a failed flush is seen
+        if(!out)
+            throw file_error(tmp_name, false);
+        boost::filesystem::rename(tmp_name, name);
+    }
+    catch(file_error&) {
+        boost::system::error_code ignored;
+        boost::filesystem::remove(tmp_name, ignored);
+        throw;
+    }
+    catch(boost::filesystem::filesystem_error&) { // from rename
+        boost::system::error_code ignored;
+        boost::filesystem::remove(tmp_name, ignored);
+        throw file_error(name, false);
+    }
+}
+
+void cache::read(const path& name, const model& m, const flv& weights) {
+    namespace bip = boost::interprocess;
+    boost::shared_ptr<bip::mapped_region> region;
+    try {
+        bip::file_mapping file(name.string().c_str(), bip::read_only);
+        region.reset(new bip::mapped_region(file, bip::read_only)); // stays valid after file is closed
+    }
+    catch(bip::interprocess_exception&) {
+        throw file_error(name, true);
+    }
+    if(region->get_size() < sizeof(grid_file_header)) throw cache_mismatch();
+    const char* bytes = static_cast<const char*>(region->get_address());
+    const grid_file_header& h = *reinterpret_cast<const grid_file_header*>(bytes);
+
+    grid_file_header expected;
+    fill_header(expected, scoring_function_version, receptor_hash(m), gd, atu, single_precision, weights);
+    if(std::memcmp(h.magic, expected.magic, sizeof(h.magic)) != 0 ||
+       h.version != expected.version ||
+       h.byte_order != expected.byte_order ||
+       h.value_size != expected.value_size ||
+       h.atom_typing_used != expected.atom_typing_used)
+        throw cache_mismatch();
+    if(std::memcmp(h.scoring_function_version, expected.scoring_function_version, sizeof(h.scoring_function_version)) != 0 ||
+       h.num_weights != expected.num_weights ||
+       std::memcmp(h.weights, expected.weights, sizeof(h.weights)) != 0)
+        throw energy_mismatch();
+    if(h.receptor_hash != expected.receptor_hash)
+        throw rigid_mismatch();
+    VINA_FOR(i, 3)
+    if(h.n[i] != expected.n[i] || h.begin[i] != expected.begin[i] || h.end[i] != expected.end[i])
+        throw grid_dims_mismatch();
+
+    const sz size = checked_multiply(gd[0].n+1, gd[1].n+1, gd[2].n+1) * h.value_size;
+    VINA_FOR_IN(t, grids) { // all of them before any grid points into the mapping
+        if(t >= grid_file_max_types || h.offsets[t] == 0 || grids[t].initialized()) continue;
+        if(h.offsets[t] % grid_file_alignment != 0 || h.offsets[t] + size > region->get_size())
+            throw cache_mismatch();
+    }
+    mappings.push_back(region);
+    VINA_FOR_IN(t, grids) {
+        if(t >= grid_file_max_types || h.offsets[t] == 0 || grids[t].initialized()) continue;
+        if(single_precision)
+            grids[t].init(gd, reinterpret_cast<const float*>(bytes + h.offsets[t]));
+        else
+            grids[t].init(gd, reinterpret_cast<const fl*>(bytes + h.offsets[t]));
+    }
 }
 
-template<class Archive>
-void cache::load(Archive& ar, const unsigned version) {
-    std::string name_tmp;
-    ar & name_tmp;
-    if(name_tmp != scoring_function_version) throw energy_mismatch();
-    grid_dims   gd_tmp;
-    ar &   gd_tmp;
-    if(!eq(gd_tmp, gd))                    throw grid_dims_mismatch();
-    atom_type::t atu_tmp;
-    ar &  atu_tmp;
-    if(atu_tmp != atu)                       throw cache_mismatch();
+sz cache::share() {
+    namespace bip = boost::interprocess;
+    sz size = 0;
+    VINA_FOR_IN(t, grids)
+    if(grids[t].owned_bytes() > 0)
+        size = grid_file_aligned(size + grids[t].owned_bytes());
+    if(size == 0) return 0; // nothing allocated, e.g. all the grids were read
 
-    ar & grids;
+    // anonymous and MAP_SHARED: after fork, every process maps the same physical pages
+    boost::shared_ptr<bip::mapped_region> region(new bip::mapped_region);
+    bip::mapped_region tmp(bip::anonymous_shared_memory(size));
+    region->swap(tmp);
+    char* bytes = static_cast<char*>(region->get_address());
+    sz offset = 0;
+    VINA_FOR_IN(t, grids) {
+        const sz n = grids[t].owned_bytes();
+        if(n == 0) continue;
+        grids[t].move_to(bytes + offset);
+        offset = grid_file_aligned(offset + n);
+    }
+    VINA_CHECK(::mprotect(bytes, region->get_size(), PROT_READ) == 0); // so that a stray write faults instead of changing the grids of every process
+    mappings.push_back(region);
+    return size;
 }
 
-void cache::populate(const model& m, const precalculate& p, const szv& atom_types_needed, bool display_progress) {
+sz cache::share_size() const {
+    sz size = 0;
+    VINA_FOR_IN(t, grids)
+    if(grids[t].stored_bytes() > 0)
+        size = grid_file_aligned(size + grids[t].stored_bytes());
+    return size;
+}
+
+void cache::share(char* destination, std::vector<boost::uint64_t>& offsets) {
+    offsets.assign(grids.size(), grid_not_shared);
+    sz offset = 0;
+    VINA_FOR_IN(t, grids) {
+        const sz n = grids[t].stored_bytes();
+        if(n == 0) continue;
+        grids[t].move_to(destination + offset);
+        offsets[t] = offset;
+        offset = grid_file_aligned(offset + n);
+    }
+}
+
+void cache::attach(const char* source, const std::vector<boost::uint64_t>& offsets, bool interleaved) {
+    VINA_CHECK(offsets.size() == grids.size());
+    VINA_FOR_IN(t, grids) {
+        if(offsets[t] == grid_not_shared) continue;
+        const char* values = source + offsets[t];
+        if(interleaved && single_precision)
+            grids[t].init(gd, reinterpret_cast<const voxel_corners<float>*>(values));
+        else if(interleaved)
+            grids[t].init(gd, reinterpret_cast<const voxel_corners<fl>*>(values));
+        else if(single_precision)
+            grids[t].init(gd, reinterpret_cast<const float*>(values));
+        else
+            grids[t].init(gd, reinterpret_cast<const fl*>(values));
+    }
+}
+
+grid_deviation cache::deviation(const cache& reference, const model& m, const vec& corner1, const vec& corner2, sz num_samples, rng& generator) const {
+    const fl v = 1000; // as authentic_v in main
+    grid_deviation d;
+    d.num_samples = num_samples;
+    d.num_negative = 0;
+    d.mean_de = d.max_de = d.mean_de_negative = d.max_de_negative = d.rms_df = d.max_df = 0;
+    model tmp = m;
+    sz num_forces = 0;
+    VINA_FOR(i, num_samples) {
+        conf c = tmp.get_initial_conf();
+        c.randomize(corner1, corner2, generator);
+        tmp.set(c);
+        const fl e_reference = reference.eval_deriv(tmp, v);
+        const soa_vecv forces_reference = tmp.minus_forces;
+        const fl de = std::abs(eval_deriv(tmp, v) - e_reference);
+        d.max_de = (std::max)(d.max_de, de);
+        d.mean_de += de;
+        if(e_reference < 0) {
+            ++d.num_negative;
+            d.max_de_negative = (std::max)(d.max_de_negative, de);
+            d.mean_de_negative += de;
+        }
+        VINA_FOR(j, tmp.num_movable_atoms()) {
+            const fl df2 = vec_distance_sqr(tmp.minus_forces[j], forces_reference[j]);
+            d.max_df = (std::max)(d.max_df, std::sqrt(df2));
+            d.rms_df += df2;
+            ++num_forces;
+        }
+    }
+    if(num_samples > 0) d.mean_de /= num_samples;
+    if(d.num_negative > 0) d.mean_de_negative /= d.num_negative;
+    if(num_forces > 0) d.rms_df = std::sqrt(d.rms_df / num_forces);
+    return d;
+}
+
+bool cache::populated(const szv& atom_types_needed) const {
+    VINA_FOR_IN(i, atom_types_needed)
+    if(!grids[atom_types_needed[i]].initialized())
+        return false;
+    return true;
+}
+
+struct populate_cells { // receptor atoms of each szv_grid cell, packed as structure-of-arrays for the populate kernel
+    szv begin; // cell i holds entries [begin[i], begin[i+1])
+    flv x, y, z;
+    szv table; // offset of the atom's type block in populate_aux::tables
+    populate_cells(const szv_grid& ig, sz table_block) : begin(ig.num_cells() + 1, 0) {
+        VINA_FOR(c, ig.num_cells()) {
+            for(const szv_grid::entry* a = ig.begin(c); a != ig.end(c); ++a) {
+                x.push_back(a->coords[0]);
+                y.push_back(a->coords[1]);
+                z.push_back(a->coords[2]);
+                table.push_back(a->type * table_block);
+            }
+            begin[c + 1] = x.size();
+        }
+    }
+};
+
+struct populate_kernel { // the affinities of the needed types at one point
+    szv_grid ig;
+    flv tables; // [t1][sz(factor * r2)][j] = eval_fast(t1, needed[j], r2), so that one lookup serves all needed types
+    populate_cells cells;
+    fl factor;
+    fl cutoff_sqr;
+    sz num_needed;
+    populate_kernel(const model& m, const precalculate& p, atom_type::t atu, const grid_dims& gd, const szv& needed)
+        : ig(m, szv_grid_dims(gd), p.cutoff_sqr()),
+          tables(num_atom_types(atu) * p.fast_table(0).size() * needed.size()),
+          cells(ig, p.fast_table(0).size() * needed.size()),
+          factor(p.table_factor()), cutoff_sqr(p.cutoff_sqr()), num_needed(needed.size()) {
+        const sz nat = num_atom_types(atu);
+        const sz n = p.fast_table(0).size();
+        const sz table_block = n * needed.size();
+        VINA_FOR(t1, nat)
+        VINA_FOR_IN(j, needed) {
+            const sz t2 = needed[j];
+            assert(t2 < nat);
+            const flv& fast = p.fast_table(triangular_matrix_index_permissive(nat, t1, t2));
+            VINA_FOR(i, n)
+            tables[t1 * table_block + i * needed.size() + j] = fast[i];
+        }
+    }
+    void accumulate(sz k, fl r2, flv& affinities) const {
+        const fl* row = &tables[cells.table[k] + sz(factor * r2) * num_needed];
+        VINA_FOR_IN(j, affinities)
+        affinities[j] += row[j];
+    }
+    void operator()(const vec& probe_coords, flv& affinities) const {
+        std::fill(affinities.begin(), affinities.end(), 0);
+        const sz c = ig.cell_index(probe_coords);
+        const sz end = cells.begin[c + 1];
+        sz k = cells.begin[c];
+#ifdef __AVX2__
+        const __m256d px = _mm256_set1_pd(probe_coords[0]);
+        const __m256d py = _mm256_set1_pd(probe_coords[1]);
+        const __m256d pz = _mm256_set1_pd(probe_coords[2]);
+        const __m256d cutoff = _mm256_set1_pd(cutoff_sqr);
+        for(; k + 4 <= end; k += 4) { // same operations as vec_distance_sqr, 4 atoms at a time
+            const __m256d dx = _mm256_sub_pd(_mm256_loadu_pd(&cells.x[k]), px);
+            const __m256d dy = _mm256_sub_pd(_mm256_loadu_pd(&cells.y[k]), py);
+            const __m256d dz = _mm256_sub_pd(_mm256_loadu_pd(&cells.z[k]), pz);
+            const __m256d r2 = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)), _mm256_mul_pd(dz, dz));
+            const int in_range = _mm256_movemask_pd(_mm256_cmp_pd(r2, cutoff, _CMP_LE_OQ));
+            if(in_range == 0) continue;
+            double r2s[4];
+            _mm256_storeu_pd(r2s, r2);
+            VINA_FOR(l, 4)
+            if(in_range & (1 << l))
+                accumulate(k + l, r2s[l], affinities); // in atom order, so the sums match the scalar path exactly
+        }
+#endif
+        for(; k < end; ++k) {
+            const fl dx = cells.x[k] - probe_coords[0];
+            const fl dy = cells.y[k] - probe_coords[1];
+            const fl dz = cells.z[k] - probe_coords[2];
+            const fl r2 = sqr(dx) + sqr(dy) + sqr(dz);
+            if(r2 <= cutoff_sqr)
+                accumulate(k, r2, affinities);
+        }
+    }
+};
+
+struct populate_aux { // fills one xy-slab of the needed grids; slabs are independent, so the result does not depend on the number of threads
+    const populate_kernel& kernel;
+    const szv& needed;
+    std::vector<grid>& grids;
+    populate_aux(const populate_kernel& kernel_, const szv& needed_, std::vector<grid>& grids_) : kernel(kernel_), needed(needed_), grids(grids_) {}
+    void operator()(sz z) const {
+        flv affinities(needed.size());
+
+        const grid& g = grids[needed.front()];
+
+        VINA_FOR(y, g.m_data.dim1())
+        VINA_FOR(x, g.m_data.dim0()) {
+            kernel(g.index_to_argument(x, y, z), affinities);
+            VINA_FOR_IN(j, needed)
+            grids[needed[j]].m_data(x, y, z) = affinities[j];
+        }
+    }
+};
+
+const sz brick_size = 8; // grid points along each side of a brick
+
+// The values of the grids of the needed types, computed a brick of points at a
+// time when first used. Concurrent readers may compute the same brick; the
+// first one to finish publishes it and the others discard their copies, which
+// are identical.
+struct grid_bricks : public grid_source {
+    grid_bricks(const model& m, const precalculate& p, atom_type::t atu, const grid_dims& gd, const szv& needed)
+        : kernel(m, p, atu, gd, needed), num_needed(needed.size()), num_filled(0) {
+        geometry.init(gd, this, 0);
+        VINA_FOR(i, 3) {
+            num_points[i] = gd[i].n + 1;
+            num_bricks[i] = (num_points[i] + brick_size - 1) / brick_size;
+        }
+        bricks.reset(new boost::atomic<const fl*>[checked_multiply(num_bricks[0], num_bricks[1], num_bricks[2])]);
+        VINA_FOR(i, size())
+        bricks[i].store(NULL);
+    }
+    ~grid_bricks() {
+        VINA_FOR(i, size())
+        delete[] bricks[i].load();
+    }
+    sz size() const {
+        return num_bricks[0] * num_bricks[1] * num_bricks[2];
+    }
+    sz filled() const {
+        return num_filled.load();
+    }
+    voxel_corners<fl> corners(sz slot, sz x, sz y, sz z) const {
+        voxel_corners<fl> tmp;
+        if(x % brick_size + 1 < brick_size && y % brick_size + 1 < brick_size && z % brick_size + 1 < brick_size) { // all in one brick
+            const fl* b = brick(x / brick_size, y / brick_size, z / brick_size) + slot * brick_size * brick_size * brick_size;
+            const sz i = x % brick_size + brick_size * (y % brick_size + brick_size * (z % brick_size));
+            const sz dy = brick_size;
+            const sz dz = brick_size * brick_size;
+            tmp.f[0] = b[i];
+            tmp.f[1] = b[i + 1];
+            tmp.f[2] = b[i + dy];
+            tmp.f[3] = b[i + dy + 1];
+            tmp.f[4] = b[i + dz];
+            tmp.f[5] = b[i + dz + 1];
+            tmp.f[6] = b[i + dz + dy];
+            tmp.f[7] = b[i + dz + dy + 1];
+        }
+        else
+            VINA_FOR(k, 8)
+            tmp.f[k] = value(slot, x + (k & 1), y + ((k >> 1) & 1), z + (k >> 2));
+        return tmp;
+    }
+private:
+    populate_kernel kernel;
+    sz num_needed;
+    grid geometry;
+    sz num_points[3];
+    sz num_bricks[3];
+    boost::scoped_array<boost::atomic<const fl*> > bricks; // NULL until filled
+    mutable boost::atomic<sz> num_filled;
+
+    fl value(sz slot, sz x, sz y, sz z) const {
+        const fl* b = brick(x / brick_size, y / brick_size, z / brick_size) + slot * brick_size * brick_size * brick_size;
+        return b[x % brick_size + brick_size * (y % brick_size + brick_size * (z % brick_size))];
+    }
+    const fl* brick(sz i, sz j, sz k) const {
+        boost::atomic<const fl*>& b = bricks[i + num_bricks[0] * (j + num_bricks[1] * k)];
+        const fl* tmp = b.load(boost::memory_order_acquire);
+        if(tmp)
+            return tmp;
+        return fill(i, j, k, b);
+    }
+    const fl* fill(sz i, sz j, sz k, boost::atomic<const fl*>& b) const {
+        const sz points = brick_size * brick_size * brick_size;
+        fl* tmp = new fl[num_needed * points];
+        std::fill(tmp, tmp + num_needed * points, 0);
+        flv affinities(num_needed);
+        VINA_FOR(z, brick_size)
+        VINA_FOR(y, brick_size)
+        VINA_FOR(x, brick_size) {
+            const sz gx = i * brick_size + x;
+            const sz gy = j * brick_size + y;
+            const sz gz = k * brick_size + z;
+            if(gx >= num_points[0] || gy >= num_points[1] || gz >= num_points[2]) continue;
+            kernel(geometry.index_to_argument(gx, gy, gz), affinities);
+            VINA_FOR(slot, num_needed)
+            tmp[slot * points + x + brick_size * (y + brick_size * z)] = affinities[slot];
+        }
+        const fl* expected = NULL;
+        if(b.compare_exchange_strong(expected, tmp, boost::memory_order_acq_rel, boost::memory_order_acquire)) {
+            ++num_filled;
+            return tmp;
+        }
+        delete[] tmp;
+        return expected;
+    }
+};
+
+void cache::populate(const model& m, const precalculate& p, const szv& atom_types_needed, bool display_progress, sz num_threads) {
     szv needed;
     VINA_FOR_IN(i, atom_types_needed) {
         sz t = atom_types_needed[i];
-        if(!grids[t].initialized()) {
+        if(!grids[t].initialized())
             needed.push_back(t);
-            grids[t].init(gd);
-        }
     }
     if(needed.empty())
         return;
-    flv affinities(needed.size());
 
-    sz nat = num_atom_types(atu);
+    if(lazy) {
+        boost::shared_ptr<grid_bricks> b(new grid_bricks(m, p, atu, gd, needed));
+        VINA_FOR_IN(j, needed)
+        grids[needed[j]].init(gd, b.get(), j);
+        bricks.push_back(b);
+        return;
+    }
 
-    grid& g = grids[needed.front()];
-
-    const fl cutoff_sqr = p.cutoff_sqr();
-
-    grid_dims gd_reduced = szv_grid_dims(gd);
-    szv_grid ig(m, gd_reduced, cutoff_sqr);
-
-    VINA_FOR(x, g.m_data.dim0()) {
-        VINA_FOR(y, g.m_data.dim1()) {
-            VINA_FOR(z, g.m_data.dim2()) {
-                std::fill(affinities.begin(), affinities.end(), 0);
-                vec probe_coords;
-                probe_coords = g.index_to_argument(x, y, z);
-                const szv& possibilities = ig.possibilities(probe_coords);
-                VINA_FOR_IN(possibilities_i, possibilities) {
-                    const sz i = possibilities[possibilities_i];
-                    const atom& a = m.grid_atoms[i];
-                    const sz t1 = a.get(atu);
-                    if(t1 >= nat) continue;
-                    const fl r2 = vec_distance_sqr(a.coords, probe_coords);
-                    if(r2 <= cutoff_sqr) {
-                        VINA_FOR_IN(j, needed) {
-                            const sz t2 = needed[j];
-                            assert(t2 < nat);
-                            const sz type_pair_index = triangular_matrix_index_permissive(num_atom_types(atu), t1, t2);
-                            affinities[j] += p.eval_fast(type_pair_index, r2);
-                        }
-                    }
-                }
-                VINA_FOR_IN(j, needed) {
-                    sz t = needed[j];
-                    assert(t < nat);
-                    grids[t].m_data(x, y, z) = affinities[j];
-                }
-            }
-        }
+    VINA_FOR_IN(j, needed)
+    grids[needed[j]].init(gd);
+
+    populate_kernel kernel(m, p, atu, gd, needed);
+    populate_aux aux(kernel, needed, grids);
+    const sz num_slabs = grids[needed.front()].m_data.dim2(); // z is the slowest index, so each slab is contiguous
+    if(num_threads > 1)
+        thread_pool::process_wide(num_threads).run(aux, num_slabs);
+    else {
+        VINA_FOR(z, num_slabs)
+        aux(z);
+    }
+    if(single_precision)
+        VINA_FOR_IN(j, needed)
+        grids[needed[j]].make_single();
+}
+
+fl cache::lazy_fraction() const {
+    sz filled = 0;
+    sz size = 0;
+    VINA_FOR_IN(i, bricks) {
+        filled += bricks[i]->filled();
+        size += bricks[i]->size();
     }
+    return (size > 0) ? fl(filled) / size : 0;
 }
@@ -24,38 +24,66 @@
 #define VINA_CACHE_H
 
 #include <string>
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
 #include "igrid.h"
 #include "grid.h"
 #include "model.h"
 
+namespace boost {
+namespace interprocess {
+class mapped_region; // forward declaration
+}
+}
+
+struct grid_bricks; // forward declaration
+
+const boost::uint64_t grid_not_shared = boost::uint64_t(-1); // see cache::share
+
 struct cache_mismatch {};
 struct rigid_mismatch : public cache_mismatch {};
 struct grid_dims_mismatch : public cache_mismatch {};
 struct energy_mismatch : public cache_mismatch {};
 
+struct grid_deviation { // of the intermolecular energy and forces, see cache::deviation
+    sz num_samples;
+    sz num_negative; // samples with a negative reference energy
+    fl mean_de, max_de;
+    fl mean_de_negative, max_de_negative;
+    fl rms_df, max_df; // per movable atom
+};
+
 struct cache : public igrid {
-    cache(const std::string& scoring_function_version_, const grid_dims& gd_, fl slope_, atom_type::t atom_typing_used_);
+    cache(const std::string& scoring_function_version_, const grid_dims& gd_, fl slope_, atom_type::t atom_typing_used_, bool single_precision_ = false, bool lazy_ = false);
     fl eval      (const model& m, fl v) const; // needs m.coords // clean up
     fl eval_deriv(      model& m, fl v) const; // needs m.coords, sets m.minus_forces // clean up
-#if 0 // no longer doing I/O of the cache
-    void read(const path& name); // can throw cache_mismatch
-    void write(const path& name) const;
-#endif
-    void populate(const model& m, const precalculate& p, const szv& atom_types_needed, bool display_progress = true);
+    fl eval_deriv(const szv& types, const soa_vecv& coords, fl v, soa_vecv& minus_forces) const; // the same for atoms given directly, e.g. to time lookups
+    std::string file_name(const model& m, const flv& weights) const; // identifies receptor, box and weights, for use in a cache directory
+    void read(const path& name, const model& m, const flv& weights); // can throw cache_mismatch; maps the file, read-only
+    void write(const path& name, const model& m, const flv& weights) const; // writes the initialized grids
+    bool populated(const szv& atom_types_needed) const;
+    void populate(const model& m, const precalculate& p, const szv& atom_types_needed, bool display_progress = true, sz num_threads = 1);
+    bool is_lazy() const {
+        return lazy;
+    }
+    fl lazy_fraction() const; // of the bricks of lazy grids that have been computed so far
+    void interleave(); // see grid::make_interleaved; the grids can not be written after this
+    sz share(); // moves the grids into a read-only mapping that forked processes share, returns its size; lazy grids stay private
+    sz share_size() const; // of the memory that share(destination, offsets) fills
+    void share(char* destination, std::vector<boost::uint64_t>& offsets); // copies all but the lazy grids to destination and views them there; offsets[t] is that of grid t, or grid_not_shared
+    void attach(const char* source, const std::vector<boost::uint64_t>& offsets, bool interleaved); // views the grids that a cache of the same configuration shared at source
+    grid_deviation deviation(const cache& reference, const model& m, const vec& corner1, const vec& corner2, sz num_samples, rng& generator) const; // over random placements of the ligands of m
 private:
     std::string scoring_function_version;
-    atomv atoms; // for verification
     grid_dims gd;
     fl slope; // does not get (de-)serialized
     atom_type::t atu;
+    bool single_precision; // grids are stored as float (see grid::make_single)
+    bool lazy; // populate only prepares the grids, their values are computed in bricks when first used (not combined with single_precision)
     std::vector<grid> grids;
-
-    friend class boost::serialization::access;
-    template<class Archive>
-    void save(Archive& ar, const unsigned version) const;
-    template<class Archive>
-    void load(Archive& ar, const unsigned version);
-    BOOST_SERIALIZATION_SPLIT_MEMBER()
+    boost::uint64_t receptor_hash(const model& m) const; // of the types and coordinates of m.grid_atoms, identifies the receptor in cache files
+    std::vector<boost::shared_ptr<boost::interprocess::mapped_region> > mappings; // back the grids that were read or shared
+    std::vector<boost::shared_ptr<grid_bricks> > bricks; // back the lazy grids
 };
 
 #endif
@@ -27,6 +27,7 @@
 
 #include "quaternion.h"
 #include "random.h"
+#include "soa_vecv.h"
 
 struct scale {
     fl position;
@@ -85,7 +86,7 @@ struct rigid_change {
         ::print(position);
         ::print(orientation);
     }
-    void getV( std::vector<double>& out)
+    void getV( std::vector<double>& out) const
     {
         ::getV(position,out);
         ::getV(orientation,out);
@@ -133,18 +134,18 @@ struct rigid_conf {
         else
             mutate_orientation(orientation_spread, generator);
     }
-    void apply(const vecv& in, vecv& out, sz begin, sz end) const {
+    void apply(const soa_vecv& in, soa_vecv& out, sz begin, sz end) const {
         assert(in.size() == out.size());
         const mat m = quaternion_to_r3(orientation);
         VINA_RANGE(i, begin, end)
-        out[i] = m * in[i] + position;
+        out.set(i, m * in[i] + position);
     }
     void print() const {
         ::print(position);
         ::print(orientation);
     }
 
-    void getV(std::vector<double> & out)
+    void getV(std::vector<double> & out) const
     {
         ::getV(position,out);
         ::getV(orientation,out);
@@ -166,7 +167,7 @@ struct ligand_change {
         rigid.print();
         printnl(torsions);
     }
-    void getV(std::vector<double> & out)
+    void getV(std::vector<double> & out) const
     {
         rigid.getV(out);
         for (int i=0; i<torsions.size(); i++)
@@ -196,7 +197,7 @@ struct ligand_conf {
         printnl(torsions);
     }
 
-    void getV(std::vector<double> & out)
+    void getV(std::vector<double> & out) const
     {
         rigid.getV(out);
         for (int i=0; i<torsions.size(); i++)
@@ -218,7 +219,7 @@ struct residue_change {
     void print() const {
         printnl(torsions);
     }
-    void getV(std::vector<double>& out)
+    void getV(std::vector<double>& out) const
     {
         for (int i=0; i<torsions.size(); i++)
         {
@@ -241,7 +242,7 @@ struct residue_conf {
     void print() const {
         printnl(torsions);
     }
-    void getV(std::vector<double>& out)
+    void getV(std::vector<double>& out) const
     {
         for (int i=0; i<torsions.size(); i++)
         {
@@ -315,7 +316,7 @@ struct change {
         VINA_FOR_IN(i, flex)
         flex[i].print();
     }
-    void getV(std::vector<double>& out)  {
+    void getV(std::vector<double>& out) const {
         VINA_FOR_IN(i, ligands)
         ligands[i].getV(out);
         VINA_FOR_IN(i, flex)
@@ -397,7 +398,7 @@ struct conf {
         VINA_FOR_IN(i, flex)
         flex[i].print();
     }
-    void getV(std::vector<double>& out)
+    void getV(std::vector<double>& out) const
     {
         VINA_FOR_IN(i, ligands)
         ligands[i].getV(out);
@@ -28,7 +28,7 @@
 
 fl rmsd_upper_bound(const vecv& a, const vecv& b);
 std::pair<sz, fl> find_closest(const vecv& a, const output_container& b);
-void add_to_output_container(output_container& out, const output_type& t, fl min_rmsd, sz max_size);
+bool add_to_output_container(output_container& out, const output_type& t, fl min_rmsd, sz max_size); // whether out changed
 
 
 #endif
@@ -20,85 +20,178 @@
 
 */
 
+#include <climits> // INT_MAX
+#include <cstring> // memcpy
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 #include "grid.h"
 
 void grid::init(const grid_dims& gd) {
+    release();
     m_data.resize(gd[0].n+1, gd[1].n+1, gd[2].n+1);
-    m_init = vec(gd[0].begin, gd[1].begin, gd[2].begin);
-    m_range = vec(gd[0].span(), gd[1].span(), gd[2].span());
-    assert(m_range[0] > 0);
-    assert(m_range[1] > 0);
-    assert(m_range[2] > 0);
-    m_dim_fl_minus_1 = vec(m_data.dim0() - 1.0,
-                           m_data.dim1() - 1.0,
-                           m_data.dim2() - 1.0);
-    VINA_FOR(i, 3) {
-        m_factor[i] = m_dim_fl_minus_1[i] / m_range[i];
-        m_factor_inv[i] = 1 / m_factor[i];
-    }
+    init_geometry(gd);
 }
 
-fl grid::evaluate_aux(const vec& location, fl slope, fl v, vec* deriv) const { // sets *deriv if not NULL
-    vec s  = elementwise_product(location - m_init, m_factor);
+void grid::init(const grid_dims& gd, const fl* values) {
+    release();
+    m_data.view(gd[0].n+1, gd[1].n+1, gd[2].n+1, values);
+    init_geometry(gd);
+}
 
-    vec miss(0, 0, 0);
-    boost::array<int, 3> region;
-    boost::array<sz, 3> a;
+void grid::init(const grid_dims& gd, const float* values) {
+    release();
+    m_single.view(gd[0].n+1, gd[1].n+1, gd[2].n+1, values);
+    init_geometry(gd);
+}
 
-    VINA_FOR(i, 3) {
-        if(s[i] < 0) {
-            miss[i] = -s[i];
-            region[i] = -1;
-            a[i] = 0;
-            s[i] = 0;
-        }
-        else if(s[i] >= m_dim_fl_minus_1[i]) {
-            miss[i] = s[i] - m_dim_fl_minus_1[i];
-            region[i] = 1;
-            assert(m_data.dim(i) >= 2);
-            a[i] = m_data.dim(i) -  2;
-            s[i] = 1;
-        }
-        else {
-            region[i] = 0; // now that region is boost::array, it's not initialized
-            a[i] = sz(s[i]);
-            s[i] -= a[i];
-        }
-        assert(s[i] >= 0);
-        assert(s[i] <= 1);
-        assert(a[i] >= 0);
-        assert(a[i]+1 < m_data.dim(i));
-    }
-    const fl penalty = slope * (miss * m_factor_inv); // FIXME check that inv_factor is correctly initialized and serialized
-    assert(penalty > -epsilon_fl);
+void grid::init(const grid_dims& gd, const voxel_corners<fl>* voxels) {
+    release();
+    m_voxels.view(gd[0].n, gd[1].n, gd[2].n, voxels);
+    init_geometry(gd);
+}
 
-    const sz x0 = a[0];
-    const sz y0 = a[1];
-    const sz z0 = a[2];
+void grid::init(const grid_dims& gd, const voxel_corners<float>* voxels) {
+    release();
+    m_voxels_single.view(gd[0].n, gd[1].n, gd[2].n, voxels);
+    init_geometry(gd);
+}
 
+void grid::init(const grid_dims& gd, const grid_source* source, sz slot) {
+    release();
+    m_source = source;
+    m_source_slot = slot;
+    init_geometry(gd);
+}
+
+void grid::release() {
+    m_source = NULL;
+    m_data.clear();
+    m_single.clear();
+    m_voxels.clear();
+    m_voxels_single.clear();
+    m_voxel_buffer.reset();
+}
+
+void grid::make_single() {
+    m_single.resize(m_data.dim0(), m_data.dim1(), m_data.dim2());
+    VINA_FOR(i, m_data.dim0())
+    VINA_FOR(j, m_data.dim1())
+    VINA_FOR(k, m_data.dim2())
+    m_single(i, j, k) = float(m_data(i, j, k));
+    m_data.clear();
+}
+
+template<typename T>
+voxel_corners<T> corners(const array3d<T>& data, sz x0, sz y0, sz z0) {
     const sz x1 = x0+1;
     const sz y1 = y0+1;
     const sz z1 = z0+1;
 
+    voxel_corners<T> tmp;
+    tmp.f[0] = data(x0, y0, z0);
+    tmp.f[1] = data(x1, y0, z0);
+    tmp.f[2] = data(x0, y1, z0);
+    tmp.f[3] = data(x1, y1, z0);
+    tmp.f[4] = data(x0, y0, z1);
+    tmp.f[5] = data(x1, y0, z1);
+    tmp.f[6] = data(x0, y1, z1);
+    tmp.f[7] = data(x1, y1, z1);
+    return tmp;
+}
+
+const sz cache_line_size = 64;
 
-    const fl f000 = m_data(x0, y0, z0);
-    const fl f100 = m_data(x1, y0, z0);
-    const fl f010 = m_data(x0, y1, z0);
-    const fl f110 = m_data(x1, y1, z0);
-    const fl f001 = m_data(x0, y0, z1);
-    const fl f101 = m_data(x1, y0, z1);
-    const fl f011 = m_data(x0, y1, z1);
-    const fl f111 = m_data(x1, y1, z1);
+template<typename T>
+void interleave(array3d<T>& data, array3d<voxel_corners<T> >& voxels, boost::shared_array<char>& buffer) {
+    assert(data.dim0() >= 2 && data.dim1() >= 2 && data.dim2() >= 2);
+    const sz nx = data.dim0() - 1;
+    const sz ny = data.dim1() - 1;
+    const sz nz = data.dim2() - 1;
+    buffer.reset(new char[checked_multiply(nx, ny, nz) * sizeof(voxel_corners<T>) + cache_line_size]);
+    const std::size_t address = reinterpret_cast<std::size_t>(buffer.get());
+    voxel_corners<T>* v = reinterpret_cast<voxel_corners<T>*>((address + cache_line_size - 1) / cache_line_size * cache_line_size);
+    VINA_FOR(z, nz)
+    VINA_FOR(y, ny)
+    VINA_FOR(x, nx)
+    v[x + nx*(y + ny*z)] = corners(data, x, y, z);
+    voxels.view(nx, ny, nz, v);
+    data.clear();
+}
 
-    const fl x = s[0];
-    const fl y = s[1];
-    const fl z = s[2];
+void grid::make_interleaved() {
+    if(single())
+        interleave(m_single, m_voxels_single, m_voxel_buffer);
+    else
+        interleave(m_data, m_voxels, m_voxel_buffer);
+}
 
-    const fl mx = 1-x;
-    const fl my = 1-y;
-    const fl mz = 1-z;
+sz grid::stored_bytes() const {
+    if(lazy()) return 0;
+    if(m_voxels.size() > 0)        return m_voxels.size()        * sizeof(voxel_corners<fl>);
+    if(m_voxels_single.size() > 0) return m_voxels_single.size() * sizeof(voxel_corners<float>);
+    if(m_single.size() > 0)        return m_single.size() * sizeof(float);
+    return m_data.size() * sizeof(fl);
+}
+
+sz grid::owned_bytes() const {
+    if(interleaved()) return m_voxel_buffer ? stored_bytes() : 0;
+    return (m_single.is_view() || m_data.is_view()) ? 0 : stored_bytes();
+}
+
+template<typename T>
+void move_values(array3d<T>& values, char* destination) {
+    std::memcpy(destination, values.data(), values.size() * sizeof(T));
+    values.view(values.dim0(), values.dim1(), values.dim2(), reinterpret_cast<const T*>(destination));
+}
+
+void grid::move_to(char* destination) {
+    assert(reinterpret_cast<std::size_t>(destination) % cache_line_size == 0);
+    if(stored_bytes() == 0) return;
+    if(m_voxels.size() > 0)             move_values(m_voxels, destination);
+    else if(m_voxels_single.size() > 0) move_values(m_voxels_single, destination);
+    else if(m_single.size() > 0)        move_values(m_single, destination);
+    else                                move_values(m_data, destination);
+    m_voxel_buffer.reset();
+}
 
-    fl f =
+void grid::init_geometry(const grid_dims& gd) {
+    m_init = vec(gd[0].begin, gd[1].begin, gd[2].begin);
+    m_range = vec(gd[0].span(), gd[1].span(), gd[2].span());
+    assert(m_range[0] > 0);
+    assert(m_range[1] > 0);
+    assert(m_range[2] > 0);
+    m_dim_fl_minus_1 = vec(gd[0].n,
+                           gd[1].n,
+                           gd[2].n); // the dimensions are n+1
+    VINA_FOR(i, 3) {
+        m_factor[i] = m_dim_fl_minus_1[i] / m_range[i];
+        m_factor_inv[i] = 1 / m_factor[i];
+    }
+}
+
+template<typename T>
+fl interpolate(const voxel_corners<T>& corners, const vec& s, vec* gradient) { // trilinear, in the precision of the stored values; sets *gradient if not NULL
+    const T f000 = corners.f[0];
+    const T f100 = corners.f[1];
+    const T f010 = corners.f[2];
+    const T f110 = corners.f[3];
+    const T f001 = corners.f[4];
+    const T f101 = corners.f[5];
+    const T f011 = corners.f[6];
+    const T f111 = corners.f[7];
+
+    const T x = T(s[0]);
+    const T y = T(s[1]);
+    const T z = T(s[2]);
+
+    const T mx = 1-x;
+    const T my = 1-y;
+    const T mz = 1-z;
+
+    const T f =
         f000 *  mx * my * mz  +
         f100 *   x * my * mz  +
         f010 *  mx *  y * mz  +
@@ -108,8 +201,8 @@ fl grid::evaluate_aux(const vec& location, fl slope, fl v, vec* deriv) const { /
         f011 *  mx *  y *  z  +
         f111 *   x *  y *  z  ;
 
-    if(deriv) { // valid pointer
-        const fl x_g =
+    if(gradient) { // valid pointer
+        const T x_g =
             f000 * (-1)* my * mz  +
             f100 *   1 * my * mz  +
             f010 * (-1)*  y * mz  +
@@ -120,7 +213,7 @@ fl grid::evaluate_aux(const vec& location, fl slope, fl v, vec* deriv) const { /
             f111 *   1 *  y *  z  ;
 
 
-        const fl y_g =
+        const T y_g =
             f000 *  mx *(-1)* mz  +
             f100 *   x *(-1)* mz  +
             f010 *  mx *  1 * mz  +
@@ -131,7 +224,7 @@ fl grid::evaluate_aux(const vec& location, fl slope, fl v, vec* deriv) const { /
             f111 *   x *  1 *  z  ;
 
 
-        const fl z_g =
+        const T z_g =
             f000 *  mx * my *(-1) +
             f100 *   x * my *(-1) +
             f010 *  mx *  y *(-1) +
@@ -141,7 +234,59 @@ fl grid::evaluate_aux(const vec& location, fl slope, fl v, vec* deriv) const { /
             f011 *  mx *  y *  1  +
             f111 *   x *  y *  1  ;
 
-        vec gradient(x_g, y_g, z_g);
+        *gradient = vec(x_g, y_g, z_g);
+    }
+    return f;
+}
+
+fl grid::evaluate_aux(const vec& location, fl slope, fl v, vec* deriv) const { // sets *deriv if not NULL
+    vec s  = elementwise_product(location - m_init, m_factor);
+
+    vec miss(0, 0, 0);
+    boost::array<int, 3> region;
+    boost::array<sz, 3> a;
+
+    VINA_FOR(i, 3) {
+        if(s[i] < 0) {
+            miss[i] = -s[i];
+            region[i] = -1;
+            a[i] = 0;
+            s[i] = 0;
+        }
+        else if(s[i] >= m_dim_fl_minus_1[i]) {
+            miss[i] = s[i] - m_dim_fl_minus_1[i];
+            region[i] = 1;
+            assert(dim(i) >= 2);
+            a[i] = dim(i) -  2;
+            s[i] = 1;
+        }
+        else {
+            region[i] = 0; // now that region is boost::array, it's not initialized
+            a[i] = sz(s[i]);
+            s[i] -= a[i];
+        }
+        assert(s[i] >= 0);
+        assert(s[i] <= 1);
+        assert(a[i] >= 0);
+        assert(a[i]+1 < dim(i));
+    }
+    const fl penalty = slope * (miss * m_factor_inv); // FIXME check that inv_factor is correctly initialized and serialized
+    assert(penalty > -epsilon_fl);
+
+    vec gradient;
+    fl f;
+    if(lazy())
+        f = interpolate(m_source->corners(m_source_slot, a[0], a[1], a[2]), s, deriv ? &gradient : NULL);
+    else if(m_voxels.size() > 0)
+        f = interpolate(m_voxels(a[0], a[1], a[2]), s, deriv ? &gradient : NULL);
+    else if(m_voxels_single.size() > 0)
+        f = interpolate(m_voxels_single(a[0], a[1], a[2]), s, deriv ? &gradient : NULL);
+    else if(single())
+        f = interpolate(corners(m_single, a[0], a[1], a[2]), s, deriv ? &gradient : NULL);
+    else
+        f = interpolate(corners(m_data, a[0], a[1], a[2]), s, deriv ? &gradient : NULL);
+
+    if(deriv) { // valid pointer
         curl(f, gradient, v);
         vec gradient_everywhere;
 
@@ -157,3 +302,181 @@ fl grid::evaluate_aux(const vec& location, fl slope, fl v, vec* deriv) const { /
         return f + penalty;
     }
 }
+
+#ifdef __AVX2__
+
+// 4 lanes of the precision the grid values are stored in; the operations are
+// the ones interpolate does, one lane per atom, so that the results are the same
+struct lanes_double {
+    typedef fl scalar;
+    typedef __m256d type;
+    static type gather(const scalar* base, __m128i index) { return _mm256_i32gather_pd(base, index, 8); }
+    static type from_double(__m256d x) { return x; }
+    static __m256d to_double(type x) { return x; }
+    static type set1(scalar x) { return _mm256_set1_pd(x); }
+    static type add(type x, type y) { return _mm256_add_pd(x, y); }
+    static type sub(type x, type y) { return _mm256_sub_pd(x, y); }
+    static type mul(type x, type y) { return _mm256_mul_pd(x, y); }
+};
+
+struct lanes_single {
+    typedef float scalar;
+    typedef __m128 type;
+    static type gather(const scalar* base, __m128i index) { return _mm_i32gather_ps(base, index, 4); }
+    static type from_double(__m256d x) { return _mm256_cvtpd_ps(x); }
+    static __m256d to_double(type x) { return _mm256_cvtps_pd(x); }
+    static type set1(scalar x) { return _mm_set1_ps(x); }
+    static type add(type x, type y) { return _mm_add_ps(x, y); }
+    static type sub(type x, type y) { return _mm_sub_ps(x, y); }
+    static type mul(type x, type y) { return _mm_mul_ps(x, y); }
+};
+
+template<typename L>
+void interpolate4(const typename L::scalar* values, __m128i index, const int* corners, const __m256d* s, __m256d& f_out, __m256d* gradient) {
+    typedef typename L::type V;
+    V f[8];
+    VINA_FOR(k, 8)
+    f[k] = L::gather(values, _mm_add_epi32(index, _mm_set1_epi32(corners[k])));
+
+    const V x = L::from_double(s[0]);
+    const V y = L::from_double(s[1]);
+    const V z = L::from_double(s[2]);
+
+    const V one = L::set1(1);
+    const V minus_one = L::set1(-1);
+    const V mx = L::sub(one, x);
+    const V my = L::sub(one, y);
+    const V mz = L::sub(one, z);
+
+    const V f_x[8] = { L::mul(f[0], mx), L::mul(f[1], x), L::mul(f[2], mx), L::mul(f[3], x),
+                       L::mul(f[4], mx), L::mul(f[5], x), L::mul(f[6], mx), L::mul(f[7], x) };
+    const V f_xy[8] = { L::mul(f_x[0], my), L::mul(f_x[1], my), L::mul(f_x[2], y), L::mul(f_x[3], y),
+                        L::mul(f_x[4], my), L::mul(f_x[5], my), L::mul(f_x[6], y), L::mul(f_x[7], y) };
+
+    V sum = L::mul(f_xy[0], mz);
+    sum = L::add(sum, L::mul(f_xy[1], mz));
+    sum = L::add(sum, L::mul(f_xy[2], mz));
+    sum = L::add(sum, L::mul(f_xy[3], mz));
+    sum = L::add(sum, L::mul(f_xy[4], z));
+    sum = L::add(sum, L::mul(f_xy[5], z));
+    sum = L::add(sum, L::mul(f_xy[6], z));
+    sum = L::add(sum, L::mul(f_xy[7], z));
+    f_out = L::to_double(sum);
+
+    // the factors of the derivative that are 1 are left out, as multiplying by them is exact
+    const V ys[4] = { my, my, y, y };
+    const V zs[2] = { mz, z };
+    V x_g = L::mul(L::mul(L::mul(f[0], minus_one), ys[0]), zs[0]);
+    VINA_RANGE(k, 1, 8) {
+        const V term = L::mul((k % 2 == 0) ? L::mul(f[k], minus_one) : f[k], ys[k % 4]);
+        x_g = L::add(x_g, L::mul(term, zs[k / 4]));
+    }
+    V y_g = L::mul(L::mul(f_x[0], minus_one), zs[0]);
+    VINA_RANGE(k, 1, 8) {
+        const V term = (k % 4 < 2) ? L::mul(f_x[k], minus_one) : f_x[k];
+        y_g = L::add(y_g, L::mul(term, zs[k / 4]));
+    }
+    V z_g = L::mul(f_xy[0], minus_one);
+    VINA_RANGE(k, 1, 8)
+    z_g = L::add(z_g, (k < 4) ? L::mul(f_xy[k], minus_one) : f_xy[k]);
+
+    gradient[0] = L::to_double(x_g);
+    gradient[1] = L::to_double(y_g);
+    gradient[2] = L::to_double(z_g);
+}
+
+#endif
+
+void grid::evaluate(const soa_vecv& coords, const sz* atoms, sz n, fl slope, fl v, fl* energies, soa_vecv& derivs) const {
+    sz i = 0;
+#ifdef __AVX2__
+    // corner k of voxel (x, y, z) is at x * strides[0] + y * strides[1] + z * strides[2] + corners[k]
+    int strides[3];
+    int corners[8];
+    sz num_values;
+    if(interleaved()) {
+        num_values = 8 * (dim(0) - 1) * (dim(1) - 1) * (dim(2) - 1);
+        strides[0] = 8;
+        strides[1] = int(8 * (dim(0) - 1));
+        strides[2] = int(8 * (dim(0) - 1) * (dim(1) - 1));
+        VINA_FOR(k, 8)
+        corners[k] = int(k);
+    }
+    else {
+        num_values = dim(0) * dim(1) * dim(2);
+        strides[0] = 1;
+        strides[1] = int(dim(0));
+        strides[2] = int(dim(0) * dim(1));
+        VINA_FOR(k, 8)
+        corners[k] = ((k & 1) ? strides[0] : 0) + ((k & 2) ? strides[1] : 0) + ((k & 4) ? strides[2] : 0);
+    }
+    if(!lazy() && num_values <= sz(INT_MAX)) {
+        const __m256d zero = _mm256_setzero_pd();
+        const __m256d one = _mm256_set1_pd(1);
+        const __m256d minus_one = _mm256_set1_pd(-1);
+        for(; i < n; i += 4) {
+            const sz lanes = (std::min)(n - i, sz(4));
+            sz lane_atoms[4];
+            VINA_FOR(l, 4)
+            lane_atoms[l] = atoms[i + (std::min)(l, lanes - 1)]; // the unused lanes repeat the last atom
+            const __m256i gather = _mm256_set_epi64x(lane_atoms[3], lane_atoms[2], lane_atoms[1], lane_atoms[0]);
+            __m256d s[3], region[3];
+            __m128i index = _mm_setzero_si128();
+            __m256d penalty = zero;
+            VINA_FOR(d, 3) { // the region classification of evaluate_aux, without branches
+                const __m256d location = _mm256_i64gather_pd(coords.data(d), gather, 8);
+                const __m256d scaled = _mm256_mul_pd(_mm256_sub_pd(location, _mm256_set1_pd(m_init[d])), _mm256_set1_pd(m_factor[d]));
+                const __m256d dim_minus_1 = _mm256_set1_pd(m_dim_fl_minus_1[d]);
+                const __m256d below = _mm256_cmp_pd(scaled, zero, _CMP_LT_OQ);
+                const __m256d above = _mm256_cmp_pd(scaled, dim_minus_1, _CMP_GE_OQ);
+                const __m256d inside = _mm256_round_pd(scaled, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+                const __m256d a = _mm256_blendv_pd(_mm256_blendv_pd(inside, _mm256_set1_pd(dim(d) - 2.0), above), zero, below);
+                const __m256d miss = _mm256_blendv_pd(_mm256_blendv_pd(zero, _mm256_sub_pd(scaled, dim_minus_1), above), _mm256_sub_pd(zero, scaled), below);
+                s[d] = _mm256_blendv_pd(_mm256_blendv_pd(_mm256_sub_pd(scaled, inside), one, above), zero, below);
+                region[d] = _mm256_blendv_pd(_mm256_blendv_pd(zero, one, above), minus_one, below);
+                index = _mm_add_epi32(index, _mm_mullo_epi32(_mm256_cvttpd_epi32(a), _mm_set1_epi32(strides[d])));
+                const __m256d weighted_miss = _mm256_mul_pd(miss, _mm256_set1_pd(m_factor_inv[d]));
+                penalty = (d == 0) ? weighted_miss : _mm256_add_pd(penalty, weighted_miss);
+            }
+            penalty = _mm256_mul_pd(_mm256_set1_pd(slope), penalty);
+
+            __m256d f;
+            __m256d gradient[3];
+            if(m_voxels.size() > 0)
+                interpolate4<lanes_double>(m_voxels.data()->f, index, corners, s, f, gradient);
+            else if(m_voxels_single.size() > 0)
+                interpolate4<lanes_single>(m_voxels_single.data()->f, index, corners, s, f, gradient);
+            else if(m_single.size() > 0)
+                interpolate4<lanes_single>(m_single.data(), index, corners, s, f, gradient);
+            else
+                interpolate4<lanes_double>(m_data.data(), index, corners, s, f, gradient);
+
+            if(not_max(v)) { // curl
+                const __m256d positive = _mm256_cmp_pd(f, zero, _CMP_GT_OQ);
+                const __m256d tmp = (v < epsilon_fl) ? zero : _mm256_div_pd(_mm256_set1_pd(v), _mm256_add_pd(_mm256_set1_pd(v), f));
+                const __m256d tmp_sqr = _mm256_mul_pd(tmp, tmp);
+                f = _mm256_blendv_pd(f, _mm256_mul_pd(f, tmp), positive);
+                VINA_FOR(d, 3)
+                gradient[d] = _mm256_blendv_pd(gradient[d], _mm256_mul_pd(gradient[d], tmp_sqr), positive);
+            }
+            double e[4];
+            double deriv[3][4];
+            _mm256_storeu_pd(e, _mm256_add_pd(f, penalty));
+            VINA_FOR(d, 3) {
+                const __m256d gradient_everywhere = _mm256_blendv_pd(zero, gradient[d], _mm256_cmp_pd(region[d], zero, _CMP_EQ_OQ));
+                _mm256_storeu_pd(deriv[d], _mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(m_factor[d]), gradient_everywhere), _mm256_mul_pd(_mm256_set1_pd(slope), region[d])));
+            }
+            VINA_FOR(l, lanes) {
+                energies[lane_atoms[l]] = e[l];
+                VINA_FOR(d, 3)
+                derivs.data(d)[lane_atoms[l]] = deriv[d][l];
+            }
+        }
+    }
+#endif
+    for(; i < n; ++i) {
+        vec deriv;
+        energies[atoms[i]] = evaluate_aux(coords[atoms[i]], slope, v, &deriv);
+        derivs.set(atoms[i], deriv);
+    }
+}
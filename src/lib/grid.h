@@ -23,9 +23,21 @@
 #ifndef VINA_GRID_H
 #define VINA_GRID_H
 
+#include <boost/shared_array.hpp>
 #include "array3d.h"
 #include "grid_dim.h"
 #include "curl.h"
+#include "soa_vecv.h"
+
+template<typename T>
+struct voxel_corners { // the values at the 8 corners of a voxel, in 000, 100, 010, 110, 001, 101, 011, 111 order
+    T f[8];
+};
+
+struct grid_source { // computes grid values on demand, see grid::init(gd, source, slot)
+    virtual ~grid_source() {}
+    virtual voxel_corners<fl> corners(sz slot, sz x, sz y, sz z) const = 0; // of voxel (x, y, z) of the grid in the given slot
+};
 
 class grid { // FIXME rm 'm_', consistent with my new style
     vec m_init;
@@ -35,18 +47,51 @@ class grid { // FIXME rm 'm_', consistent with my new style
     vec m_factor_inv;
 public:
     array3d<fl> m_data; // FIXME? - make cache a friend, and convert this back to private?
-    grid() : m_init(0, 0, 0), m_range(1, 1, 1), m_factor(1, 1, 1), m_dim_fl_minus_1(-1, -1, -1), m_factor_inv(1, 1, 1) {} // not private
-    grid(const grid_dims& gd) {
+    array3d<float> m_single; // replaces m_data after make_single
+    array3d<voxel_corners<fl> > m_voxels; // replaces m_data after make_interleaved
+    array3d<voxel_corners<float> > m_voxels_single; // replaces m_single after make_interleaved
+    boost::shared_array<char> m_voxel_buffer; // cache line aligned storage viewed by m_voxels or m_voxels_single, shared by copies
+    const grid_source* m_source; // if not NULL, provides the values instead of any storage
+    sz m_source_slot;
+    grid() : m_init(0, 0, 0), m_range(1, 1, 1), m_factor(1, 1, 1), m_dim_fl_minus_1(-1, -1, -1), m_factor_inv(1, 1, 1), m_source(NULL), m_source_slot(0) {} // not private
+    grid(const grid_dims& gd) : m_source(NULL), m_source_slot(0) {
         init(gd);
     }
     void init(const grid_dims& gd);
+    void init(const grid_dims& gd, const fl* values); // views values (see array3d::view) instead of allocating
+    void init(const grid_dims& gd, const float* values); // same, single precision
+    void init(const grid_dims& gd, const voxel_corners<fl>* voxels); // same, interleaved (see make_interleaved)
+    void init(const grid_dims& gd, const voxel_corners<float>* voxels); // same, single precision and interleaved
+    void init(const grid_dims& gd, const grid_source* source, sz slot); // no storage, source must outlive this
+    void make_single(); // rounds m_data to single precision and releases it; evaluate then interpolates in float
+    void make_interleaved(); // stores the 8 corners of each voxel together, so that evaluate reads one cache line (8 times the memory)
+    sz stored_bytes() const; // of the values in their current layout, whether owned or viewed; 0 for lazy grids
+    sz owned_bytes() const; // the same, but 0 for views
+    void move_to(char* destination); // copies the values to destination (cache line aligned, stored_bytes() long) and views them there
+    bool single() const {
+        return m_single.size() > 0 || m_voxels_single.size() > 0;
+    }
+    bool interleaved() const {
+        return m_voxels.size() > 0 || m_voxels_single.size() > 0;
+    }
+    bool lazy() const {
+        return m_source != NULL;
+    }
+    const char* bytes() const { // the values as stored, for writing; not interleaved or lazy
+        assert(!interleaved() && !lazy());
+        return (m_single.size() > 0) ? reinterpret_cast<const char*>(m_single.data()) : reinterpret_cast<const char*>(m_data.data());
+    }
+    sz num_bytes() const {
+        assert(!interleaved() && !lazy());
+        return (m_single.size() > 0) ? m_single.size() * sizeof(float) : m_data.size() * sizeof(fl);
+    }
     vec index_to_argument(sz x, sz y, sz z) const {
         return vec(m_init[0] + m_factor_inv[0] * x,
                    m_init[1] + m_factor_inv[1] * y,
                    m_init[2] + m_factor_inv[2] * z);
     }
     bool initialized() const {
-        return m_data.dim0() > 0 && m_data.dim1() > 0 && m_data.dim2() > 0;
+        return m_data.size() > 0 || m_single.size() > 0 || interleaved() || lazy();
     }
     fl evaluate(const vec& location, fl slope, fl c)             const {
         return evaluate_aux(location, slope, c, NULL);
@@ -54,7 +99,17 @@ public:
     fl evaluate(const vec& location, fl slope, fl c, vec& deriv) const {
         return evaluate_aux(location, slope, c, &deriv);    // sets deriv
     }
+    // evaluate with deriv at coords[atoms[i]] for i < n, setting energies[atoms[i]] and derivs[atoms[i]]; several atoms at a time with AVX2
+    void evaluate(const soa_vecv& coords, const sz* atoms, sz n, fl slope, fl c, fl* energies, soa_vecv& derivs) const;
 private:
+    void init_geometry(const grid_dims& gd); // after m_data or m_single is sized
+    void release(); // of all the storage
+    sz dim(sz i) const { // of the values, in any layout
+        if(lazy()) return sz(m_dim_fl_minus_1[i]) + 1;
+        if(m_voxels.size() > 0) return m_voxels.dim(i) + 1;
+        if(m_voxels_single.size() > 0) return m_voxels_single.dim(i) + 1;
+        return (m_single.size() > 0) ? m_single.dim(i) : m_data.dim(i);
+    }
     fl evaluate_aux(const vec& location, fl slope, fl v, vec* deriv) const; // sets *deriv if not NULL
     friend class boost::serialization::access;
     template<class Archive>
@@ -25,6 +25,7 @@
 
 struct incrementable {
     virtual void operator++() = 0;
+    virtual void increment(unsigned long n) = 0; // as n times ++, at once
 };
 
 #endif
@@ -27,8 +27,8 @@
 template<typename T>
 atom_range get_atom_range(const T& t) {
     atom_range tmp = t.node;
-    VINA_FOR_IN(i, t.children) {
-        atom_range r = get_atom_range(t.children[i]);
+    VINA_FOR_IN(i, t.segments) {
+        const atom_range& r = t.segments[i];
         if(tmp.begin > r.begin) tmp.begin = r.begin;
         if(tmp.end   < r.end  ) tmp.end   = r.end;
     }
@@ -42,13 +42,13 @@ struct branch_metrics {
 };
 
 template<typename T>
-branch_metrics get_branch_metrics(const T& t) {
+branch_metrics get_branch_metrics(const T& t, sz i = heterotree_node) { // of the node of t, or of its segment i
     branch_metrics tmp;
-    if(!t.children.empty()) {
+    if(t.children_begin(i) < t.children_end(i)) {
         sz corner2corner_max = 0;
         szv lengths;
-        VINA_FOR_IN(i, t.children) {
-            branch_metrics res = get_branch_metrics(t.children[i]);
+        for(sz j = t.children_begin(i); j < t.children_end(i); j = t.subtree_ends[j]) {
+            branch_metrics res = get_branch_metrics(t, j);
             if(corner2corner_max < res.corner2corner)
                 corner2corner_max = res.corner2corner;
             lengths.push_back(res.length + 1); // FIXME? weird compiler warning (sz -> unsigned)
@@ -90,7 +90,7 @@ struct appender_info {
     sz m_num_movable_atoms;
     sz atoms_size;
 
-    appender_info(const model& m) : grid_atoms_size(m.grid_atoms.size()), m_num_movable_atoms(m.m_num_movable_atoms), atoms_size(m.atoms.size()) {}
+    appender_info(const model& m) : grid_atoms_size(m.grid_atoms().size()), m_num_movable_atoms(m.m_num_movable_atoms), atoms_size(m.atoms.size()) {}
 };
 
 class appender {
@@ -165,7 +165,14 @@ public:
         update(a[i]);
     }
 
-    // internal_coords, coords, minus_forces, atoms
+    // internal_coords, coords, minus_forces
+    void coords_append(soa_vecv& a, const soa_vecv& b) { // vec needs no update, see above
+        vecv tmp(a.to_vecv());
+        coords_append(tmp, b.to_vecv());
+        soa_vecv(tmp).swap(a);
+    }
+
+    // atoms
     template<typename T>
     void coords_append(std::vector<T>& a, const std::vector<T>& b) { // first arg becomes aaaaaaaabbbbbbbbbaab
         std::vector<T> b_copy(b); // more straightforward to make a copy of b and transform that than to do piecewise transformations of the result
@@ -191,6 +198,7 @@ public:
 
 void model::append(const model& m) {
     VINA_CHECK(atom_typing_used() == m.atom_typing_used());
+    movable_groups = atom_type_groups(); // the movable atoms change, see cache::eval_deriv
 
     appender t(*this, m);
 
@@ -226,10 +234,14 @@ void model::append(const model& m) {
 
     t.append(ligands,         m.ligands);
     t.append(flex,            m.flex);
-    t.append(flex_context,    m.flex_context);
+    // the receptor stays shared unless m has one too, or m's movable atoms shift the inflex atoms, which flex_context and the grid_atoms bonds can refer to
+    if(!m.grid_atoms().empty() || !m.flex_context().empty() || (m.m_num_movable_atoms > 0 && atoms.size() > m_num_movable_atoms)) {
+        receptor& r = mutable_receptor();
+        t.append(r.flex_context, m.flex_context());
+        t.append(r.grid_atoms,   m.grid_atoms());
+    }
 
-    t       .append(grid_atoms, m.grid_atoms);
-    t.coords_append(     atoms, m     .atoms);
+    t.coords_append(atoms, m.atoms);
 
     m_num_movable_atoms += m.m_num_movable_atoms;
 }
@@ -240,8 +252,8 @@ void model::append(const model& m) {
 /////////////////// begin MODEL::INITIALIZE /////////////////////////
 
 atom_index model::sz_to_atom_index(sz i) const {
-    if(i < grid_atoms.size()) return atom_index(i                    ,  true);
-    else                      return atom_index(i - grid_atoms.size(), false);
+    if(i < grid_atoms().size()) return atom_index(i                      ,  true);
+    else                        return atom_index(i - grid_atoms().size(), false);
 }
 
 distance_type model::distance_type_between(const distance_type_matrix& mobility, const atom_index& i, const atom_index& j) const {
@@ -258,8 +270,8 @@ distance_type model::distance_type_between(const distance_type_matrix& mobility,
     return (a < b) ? mobility(a, b) : mobility(b, a);
 }
 
-const vec& model::atom_coords(const atom_index& i) const {
-    return i.in_grid ? grid_atoms[i.i].coords : coords[i.i];
+vec model::atom_coords(const atom_index& i) const {
+    return i.in_grid ? grid_atoms()[i.i].coords : coords[i.i];
 }
 
 fl model::distance_sqr_between(const atom_index& a, const atom_index& b) const {
@@ -313,7 +325,7 @@ struct beads {
 
 void model::assign_bonds(const distance_type_matrix& mobility) { // assign bonds based on relative mobility, distance and covalent length
     const fl bond_length_allowance_factor = 1.1;
-    sz n = grid_atoms.size() + atoms.size();
+    sz n = grid_atoms().size() + atoms.size();
 
     // construct beads
     const fl bead_radius = 15;
@@ -392,7 +404,8 @@ bool model::bonded_to_heteroatom(const atom& a) const {
 }
 
 void model::assign_types() {
-    VINA_FOR(i, grid_atoms.size() + atoms.size()) {
+    movable_groups = atom_type_groups(); // the types change, see cache::eval_deriv
+    VINA_FOR(i, grid_atoms().size() + atoms.size()) {
         const atom_index ai = sz_to_atom_index(i);
         atom& a = get_atom(ai);
         a.assign_el();
@@ -521,6 +534,34 @@ szv model::get_movable_atom_types(atom_type::t atom_typing_used_) const {
     return tmp;
 }
 
+szv model::get_grid_atom_types(atom_type::t atom_typing_used_) const {
+    szv tmp;
+    sz n = num_atom_types(atom_typing_used_);
+    VINA_FOR_IN(i, grid_atoms()) {
+        sz t = grid_atoms()[i].get(atom_typing_used_);
+        if(t < n && !has(tmp, t))
+            tmp.push_back(t);
+    }
+    return tmp;
+}
+
+// those of the movable atoms with each other and with the receptor
+szv model::get_type_pairs(const precalculate& p) const {
+    const szv movable = get_movable_atom_types(p.atom_typing_used());
+    szv others = get_grid_atom_types(p.atom_typing_used());
+    VINA_FOR_IN(i, movable)
+    if(!has(others, movable[i]))
+        others.push_back(movable[i]);
+    szv tmp;
+    VINA_FOR_IN(i, movable)
+    VINA_FOR_IN(j, others) {
+        const sz type_pair_index = p.index_permissive(movable[i], others[j]);
+        if(!has(tmp, type_pair_index))
+            tmp.push_back(type_pair_index);
+    }
+    return tmp;
+}
+
 conf_size model::get_size() const {
     conf_size tmp;
     tmp.ligands = ligands.count_torsions();
@@ -625,7 +666,7 @@ fl model::gyration_radius(sz ligand_number) const {
 }
 
 
-fl eval_interacting_pairs(const precalculate& p, fl v, const interacting_pairs& pairs, const vecv& coords) { // clean up
+fl eval_interacting_pairs(const precalculate& p, fl v, const interacting_pairs& pairs, const soa_vecv& coords) { // clean up
     const fl cutoff_sqr = p.cutoff_sqr();
     fl e = 0;
     VINA_FOR_IN(i, pairs) {
@@ -640,7 +681,7 @@ fl eval_interacting_pairs(const precalculate& p, fl v, const interacting_pairs&
     return e;
 }
 
-fl eval_interacting_pairs_deriv(const precalculate& p, fl v, const interacting_pairs& pairs, const vecv& coords, vecv& forces) { // adds to forces  // clean up
+fl eval_interacting_pairs_deriv(const precalculate& p, fl v, const interacting_pairs& pairs, const soa_vecv& coords, soa_vecv& forces) { // adds to forces  // clean up
     const fl cutoff_sqr = p.cutoff_sqr();
     fl e = 0;
     VINA_FOR_IN(i, pairs) {
@@ -655,8 +696,8 @@ fl eval_interacting_pairs_deriv(const precalculate& p, fl v, const interacting_p
             curl(tmp.first, force, v);
             e += tmp.first;
             // FIXME inefficient, if using hard curl
-            forces[ip.a] -= force; // we could omit forces on inflex here
-            forces[ip.b] += force;
+            forces.sub(ip.a, force); // we could omit forces on inflex here
+            forces.add(ip.b, force);
         }
     }
     return e;
@@ -713,8 +754,8 @@ fl model::eval_intramolecular(const precalculate& p, const vec& v, const conf& c
         const atom& a = atoms[i];
         sz t1 = a.get(atom_typing_used());
         if(t1 >= nat) continue;
-        VINA_FOR_IN(j, grid_atoms) {
-            const atom& b = grid_atoms[j];
+        VINA_FOR_IN(j, grid_atoms()) {
+            const atom& b = grid_atoms()[j];
             sz t2 = b.get(atom_typing_used());
             if(t2 >= nat) continue;
             fl r2 = vec_distance_sqr(coords[i], b.coords);
@@ -819,7 +860,7 @@ fl model::rmsd_ligands_upper_bound(const model& m) const {
 
 
 void model::verify_bond_lengths() const {
-    VINA_FOR(i, grid_atoms.size() + atoms.size()) {
+    VINA_FOR(i, grid_atoms().size() + atoms.size()) {
         const atom_index ai = sz_to_atom_index(i);
         const atom& a = get_atom(ai);
         VINA_FOR_IN(j, a.bonds) {
@@ -874,8 +915,8 @@ void model::print_stuff() const {
     }
 
     std::cout << "grid_atoms:\n";
-    VINA_FOR_IN(i, grid_atoms) {
-        const atom& a = grid_atoms[i];
+    VINA_FOR_IN(i, grid_atoms()) {
+        const atom& a = grid_atoms()[i];
         std::cout << a.el << " " << a.ad << " " << a.xs << " " << a.sy << "    " << a.charge << '\n';
         std::cout << a.bonds.size() << "  ";
         printnl(a.coords);
@@ -24,6 +24,7 @@
 #define VINA_MODEL_H
 
 #include <boost/optional.hpp> // for context
+#include <boost/shared_ptr.hpp>
 
 #include "file.h"
 #include "tree.h"
@@ -60,6 +61,18 @@ struct residue : public main_branch {
 enum distance_type {DISTANCE_FIXED, DISTANCE_ROTOR, DISTANCE_VARIABLE};
 typedef strictly_triangular_matrix<distance_type> distance_type_matrix;
 
+struct atom_type_groups { // the movable atoms grouped by type, see cache::eval_deriv
+    szv types; // of each movable atom, packed; num_atom_types for those without one
+    szv atoms; // indexes, ordered by type and then by index
+    szv begin; // of the group of each type, the last group holding the atoms without one
+    flv energies; // per movable atom, scratch
+};
+
+struct receptor { // the rigid part of a model, shared by its copies
+    atomv grid_atoms;
+    context flex_context;
+};
+
 struct non_cache; // forward declaration
 struct naive_non_cache; // forward declaration
 struct cache; // forward declaration
@@ -97,6 +110,8 @@ struct model {
     visited tried;
 
     szv get_movable_atom_types(atom_type::t atom_typing_used_) const;
+    szv get_grid_atom_types(atom_type::t atom_typing_used_) const;
+    szv get_type_pairs(const precalculate& p) const; // the type pair indexes of p that the intramolecular terms and non_cache look up, see precalculate::compact
 
     conf_size get_size() const;
     conf get_initial_conf() const; // torsions = 0, orientations = identity, ligand positions = current
@@ -104,7 +119,7 @@ struct model {
     grid_dims movable_atoms_box(fl add_to_each_dimension, fl granularity = 0.375) const;
 
     void write_flex  (                  const path& name, const std::string& remark) const {
-        write_context(flex_context, name, remark);
+        write_context(flex_context(), name, remark);
     }
     void write_ligand(sz ligand_number, const path& name, const std::string& remark) const {
         VINA_CHECK(ligand_number < ligands.size());
@@ -114,7 +129,7 @@ struct model {
         VINA_FOR_IN(i, ligands)
         write_context(ligands[i].cont, out);
         if(num_flex() > 0) // otherwise remark is written in vain
-            write_context(flex_context, out);
+            write_context(flex_context(), out);
     }
     void write_structure(ofile& out, const std::string& remark) const {
         out << remark;
@@ -139,12 +154,12 @@ struct model {
         assert(i < m_num_movable_atoms);
         return  atoms[i];
     }
-    const vec&       movable_coords(sz i) const {
+    vec              movable_coords(sz i) const {
         assert(i < m_num_movable_atoms);
         return coords[i];
     }
 
-    const vec& atom_coords(const atom_index& i) const;
+    vec atom_coords(const atom_index& i) const;
     fl distance_sqr_between(const atom_index& a, const atom_index& b) const;
     bool atom_exists_between(const distance_type_matrix& mobility, const atom_index& a, const atom_index& b, const szv& relevant_atoms) const; // there is an atom closer to both a and b then they are to each other and immobile relative to them
 
@@ -186,10 +201,14 @@ struct model {
     }
     vecv get_heavy_atom_movable_coords() const { // FIXME mv
         vecv tmp;
+        get_heavy_atom_movable_coords(tmp);
+        return tmp;
+    }
+    void get_heavy_atom_movable_coords(vecv& out) const { // reuses the storage of out
+        out.clear();
         VINA_FOR(i, num_movable_atoms())
         if(atoms[i].el != EL_TYPE_H)
-            tmp.push_back(coords[i]);
-        return tmp;
+            out.push_back(coords[i]);
     }
     void check_internal_pairs() const;
     void print_stuff() const; // FIXME rm
@@ -207,15 +226,27 @@ private:
     friend struct pdbqt_initializer;
     friend struct model_test;
 
-    model() : m_num_movable_atoms(0), m_atom_typing_used(atom_type::XS)
+    model() : m_receptor(new receptor), m_num_movable_atoms(0), m_atom_typing_used(atom_type::XS)
     {
     };
 
+    const atomv& grid_atoms() const {
+        return m_receptor->grid_atoms;
+    }
+    const context& flex_context() const {
+        return m_receptor->flex_context;
+    }
+    receptor& mutable_receptor() { // copied first if shared, so that the other models keep theirs
+        if(!m_receptor.unique())
+            m_receptor.reset(new receptor(*m_receptor));
+        return *m_receptor;
+    }
+
     const atom& get_atom(const atom_index& i) const {
-        return (i.in_grid ? grid_atoms[i.i] : atoms[i.i]);
+        return (i.in_grid ? grid_atoms()[i.i] : atoms[i.i]);
     }
     atom& get_atom(const atom_index& i)       {
-        return (i.in_grid ? grid_atoms[i.i] : atoms[i.i]);
+        return (i.in_grid ? mutable_receptor().grid_atoms[i.i] : atoms[i.i]);
     }
 
     void write_context(const context& c, ofile& out) const;
@@ -245,15 +276,15 @@ private:
     void initialize(const distance_type_matrix& mobility);
     fl clash_penalty_aux(const interacting_pairs& pairs) const;
 
-    vecv internal_coords;
-    vecv coords;
-    vecv minus_forces;
+    soa_vecv internal_coords;
+    soa_vecv coords;
+    soa_vecv minus_forces;
+    atom_type_groups movable_groups; // filled by cache::eval_deriv, cleared by append and assign_types
 
-    atomv grid_atoms;
+    boost::shared_ptr<receptor> m_receptor; // read only once shared, see mutable_receptor
     atomv atoms; // movable, inflex
     vector_mutable<ligand> ligands;
     vector_mutable<residue> flex;
-    context flex_context;
     interacting_pairs other_pairs; // all except internal to one ligand: ligand-other ligands; ligand-flex/inflex; flex-flex/inflex
 
     sz m_num_movable_atoms;
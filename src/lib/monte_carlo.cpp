@@ -82,37 +82,58 @@ output_type monte_carlo::many_runs(model& m, const precalculate& p, const igrid&
 */
 
 // out is sorted
-void monte_carlo::operator()(model& m, output_container& out, const precalculate& p, const igrid& ig, const precalculate& p_widened, const igrid& ig_widened, const vec& corner1, const vec& corner2, incrementable* increment_me, rng& generator) const {
+unsigned monte_carlo::operator()(model& m, output_container& out, const precalculate& p, const igrid& ig, const precalculate& p_widened, const igrid& ig_widened, const vec& corner1, const vec& corner2, incrementable* increment_me, rng& generator) const {
+    monte_carlo_chain chain(m.get_size(), temperature, lbfgs_history);
+    start(chain, corner1, corner2, generator);
+    run(m, out, chain, p, ig, num_steps, increment_me, generator);
+    VINA_CHECK(!out.empty());
+    VINA_CHECK(out.front().e <= out.back().e); // make sure the sorting worked in the correct order
+    return chain.steps_taken;
+}
+
+void monte_carlo::start(monte_carlo_chain& chain, const vec& corner1, const vec& corner2, rng& generator) const {
+    chain.current.c.randomize(corner1, corner2, generator);
+}
+
+void monte_carlo::run(model& m, output_container& out, monte_carlo_chain& chain, const precalculate& p, const igrid& ig, unsigned max_steps, incrementable* increment_me, rng& generator) const {
     vec authentic_v(1000, 1000, 1000); // FIXME? this is here to avoid max_fl/max_fl
-    conf_size s = m.get_size();
-    change g(s);
-    output_type tmp(s, 0);
-    tmp.c.randomize(corner1, corner2, generator);
-    fl best_e = max_fl;
+    change& g = chain.g;
+    output_type& tmp = chain.current;
     quasi_newton quasi_newton_par;
     quasi_newton_par.max_steps = ssd_par.evals;
-    VINA_U_FOR(step, num_steps) {
+    quasi_newton_par.lbfgs_history = lbfgs_history;
+    quasi_newton_workspace& workspace = chain.workspace; // for all the steps
+    output_type& candidate = chain.candidate; // likewise, assigned to at each step
+    const unsigned end = (num_steps - chain.steps_taken < max_steps) ? num_steps : chain.steps_taken + max_steps;
+    while(!chain.stagnated && chain.steps_taken < end) {
+        const unsigned step = chain.steps_taken++;
         if(increment_me)
             ++(*increment_me);
-        output_type candidate = tmp;
+        candidate = tmp;
         mutate_conf(candidate.c, m, mutation_amplitude, generator);
-        quasi_newton_par(m, p, ig, candidate, g, hunt_cap);
-        if(step == 0 || metropolis_accept(tmp.e, candidate.e, temperature, generator)) {
+        quasi_newton_par(m, p, ig, candidate, g, hunt_cap, workspace);
+        if(step == 0 || metropolis_accept(tmp.e, candidate.e, chain.temperature, generator)) {
             tmp = candidate;
 
             m.set(tmp.c); // FIXME? useless?
 
             // FIXME only for very promising ones
-            if(tmp.e < best_e || out.size() < num_saved_mins) {
-                quasi_newton_par(m, p, ig, tmp, g, authentic_v);
+            if(tmp.e < chain.best_e || out.size() < num_saved_mins) {
+                quasi_newton_par(m, p, ig, tmp, g, authentic_v, workspace);
                 m.set(tmp.c); // FIXME? useless?
-                tmp.coords = m.get_heavy_atom_movable_coords();
-                add_to_output_container(out, tmp, min_rmsd, num_saved_mins); // 20 - max size
-                if(tmp.e < best_e)
-                    best_e = tmp.e;
+                m.get_heavy_atom_movable_coords(tmp.coords);
+                if(add_to_output_container(out, tmp, min_rmsd, num_saved_mins)) // 20 - max size
+                    chain.last_progress = step;
+                if(tmp.e < chain.best_e - stagnation_tolerance)
+                    chain.last_progress = step;
+                if(tmp.e < chain.best_e)
+                    chain.best_e = tmp.e;
             }
         }
+        if(stagnation_steps > 0 && step - chain.last_progress >= stagnation_steps) {
+            chain.stagnated = true;
+            if(increment_me) // for the steps not taken, so that the progress still completes
+                increment_me->increment(num_steps - chain.steps_taken);
+        }
     }
-    VINA_CHECK(!out.empty());
-    VINA_CHECK(out.front().e <= out.back().e); // make sure the sorting worked in the correct order
 }
@@ -24,8 +24,24 @@
 #define VINA_MONTE_CARLO_H
 
 #include "ssd.h"
+#include "quasi_newton.h"
 #include "incrementable.h"
 
+struct monte_carlo_chain { // the state of a chain between the calls to monte_carlo::run
+    output_type current; // the conformation the next candidates are mutations of
+    fl best_e;
+    fl temperature;
+    unsigned steps_taken;
+    unsigned last_progress; // the last step that lowered best_e or changed out, see monte_carlo::stagnation_steps
+    bool stagnated;
+    output_type candidate; // the temporaries of run, kept so that it does not allocate them again at each call
+    change g;
+    quasi_newton_workspace workspace;
+    monte_carlo_chain(const conf_size& s, fl temperature_, sz lbfgs_history) // that of monte_carlo
+        : current(s, 0), best_e(max_fl), temperature(temperature_), steps_taken(0), last_progress(0), stagnated(false),
+          candidate(s, 0), g(s), workspace(current.c, g, lbfgs_history) {}
+};
+
 struct monte_carlo {
     unsigned num_steps;
     fl temperature;
@@ -34,14 +50,22 @@ struct monte_carlo {
     sz num_saved_mins;
     fl mutation_amplitude;
     ssd ssd_par;
-    monte_carlo() : num_steps(2500), temperature(1.2), hunt_cap(10, 1.5, 10), min_rmsd(0.5), num_saved_mins(50), mutation_amplitude(2) {} // T = 600K, R = 2cal/(K*mol) -> temperature = RT = 1.2;  num_steps = 50*lig_atoms = 2500
+    sz lbfgs_history; // of the local optimization, see quasi_newton
+    unsigned stagnation_steps; // a chain stops once this many steps in a row have neither lowered best_e nor changed out, 0 to always run num_steps
+    fl stagnation_tolerance; // the least decrease of best_e that counts as progress
+    monte_carlo() : num_steps(2500), temperature(1.2), hunt_cap(10, 1.5, 10), min_rmsd(0.5), num_saved_mins(50), mutation_amplitude(2), lbfgs_history(0), stagnation_steps(0), stagnation_tolerance(0.01) {} // T = 600K, R = 2cal/(K*mol) -> temperature = RT = 1.2;  num_steps = 50*lig_atoms = 2500
 
     output_type operator()(model& m, const precalculate& p, const igrid& ig, const precalculate& p_widened, const igrid& ig_widened, const vec& corner1, const vec& corner2, incrementable* increment_me, rng& generator) const;
     output_type many_runs(model& m, const precalculate& p, const igrid& ig, const vec& corner1, const vec& corner2, sz num_runs, rng& generator) const;
 
 //	void single_run(model& m, output_type& out, const precalculate& p, const igrid& ig, rng& generator) const;
-    // out is sorted
-    void operator()(model& m, output_container& out, const precalculate& p, const igrid& ig, const precalculate& p_widened, const igrid& ig_widened, const vec& corner1, const vec& corner2, incrementable* increment_me, rng& generator) const;
+    // out is sorted; returns the number of steps taken, less than num_steps when the chain stagnated
+    unsigned operator()(model& m, output_container& out, const precalculate& p, const igrid& ig, const precalculate& p_widened, const igrid& ig_widened, const vec& corner1, const vec& corner2, incrementable* increment_me, rng& generator) const;
+
+    // the same chain in parts, as replica exchange runs it (see parallel_mc::replicas): start places it at random,
+    // and each run takes up to max_steps more steps at chain.temperature, out of num_steps in all
+    void start(monte_carlo_chain& chain, const vec& corner1, const vec& corner2, rng& generator) const;
+    void run(model& m, output_container& out, monte_carlo_chain& chain, const precalculate& p, const igrid& ig, unsigned max_steps, incrementable* increment_me, rng& generator) const;
 //	void many_runs(model& m, output_container& out, const precalculate& p, const igrid& ig, const vec& corner1, const vec& corner2, sz num_runs, rng& generator) const;
 
 };
@@ -36,3 +36,17 @@ int my_pid() {
 #endif
 }
 
+std::string my_host_name() {
+    char name[256];
+#ifdef WIN32
+    DWORD size = sizeof(name);
+    if(!GetComputerNameA(name, &size))
+        return "";
+#else
+    if(gethostname(name, sizeof(name)) != 0)
+        return "";
+#endif
+    name[sizeof(name) - 1] = '\0'; // not terminated if truncated
+    return name;
+}
+
@@ -23,7 +23,10 @@
 #ifndef VINA_MY_PID_H
 #define VINA_MY_PID_H
 
+#include <string>
+
 int my_pid();
+std::string my_host_name(); // empty if unknown
 
 #endif
 
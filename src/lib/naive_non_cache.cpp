@@ -37,8 +37,8 @@ fl naive_non_cache::eval(const model& m, fl v) const { // needs m.coords
         if(t1 >= n) continue;
         const vec& a_coords = m.coords[i];
 
-        VINA_FOR_IN(j, m.grid_atoms) {
-            const atom& b = m.grid_atoms[j];
+        VINA_FOR_IN(j, m.grid_atoms()) {
+            const atom& b = m.grid_atoms()[j];
             sz t2 = b.get(p->atom_typing_used());
             if(t2 >= n) continue;
             vec r_ba;
@@ -54,18 +54,17 @@ fl non_cache::eval      (const model& m, fl v) const { // clean up
         }
         out_of_bounds_penalty *= slope;
 
-        const szv& possibilities = sgrid.possibilities(adjusted_a_coords);
+        const sz cell = sgrid.cell_index(adjusted_a_coords);
+        const szv_grid::entry* const end = sgrid.end(cell);
 
-        VINA_FOR_IN(possibilities_j, possibilities) {
-            const sz j = possibilities[possibilities_j];
-            const atom& b = m.grid_atoms[j];
-            sz t2 = b.get(p->atom_typing_used());
+        for(const szv_grid::entry* b = sgrid.begin(cell); b != end; ++b) {
+            sz t2 = b->type;
             if(t2 >= n) continue;
             vec r_ba;
-            r_ba = adjusted_a_coords - b.coords; // FIXME why b-a and not a-b ?
+            r_ba = adjusted_a_coords - b->coords; // FIXME why b-a and not a-b ?
             fl r2 = sqr(r_ba);
             if(r2 < cutoff_sqr) {
-                sz type_pair_index = get_type_pair_index(p->atom_typing_used(), a, b);
+                sz type_pair_index = triangular_matrix_index_permissive(n, t1, t2);
                 this_e +=  p->eval_fast(type_pair_index, r2);
             }
         }
@@ -101,7 +100,7 @@ fl non_cache::eval_deriv(      model& m, fl v) const { // clean up
         const atom& a = m.atoms[i];
         sz t1 = a.get(p->atom_typing_used());
         if(t1 >= n) {
-            m.minus_forces[i].assign(0);
+            m.minus_forces.set(i, zero_vec);
             continue;
         }
         const vec& a_coords = m.coords[i];
@@ -124,25 +123,24 @@ fl non_cache::eval_deriv(      model& m, fl v) const { // clean up
         out_of_bounds_penalty *= slope;
         out_of_bounds_deriv *= slope;
 
-        const szv& possibilities = sgrid.possibilities(adjusted_a_coords);
+        const sz cell = sgrid.cell_index(adjusted_a_coords);
+        const szv_grid::entry* const end = sgrid.end(cell);
 
-        VINA_FOR_IN(possibilities_j, possibilities) {
-            const sz j = possibilities[possibilities_j];
-            const atom& b = m.grid_atoms[j];
-            sz t2 = b.get(p->atom_typing_used());
+        for(const szv_grid::entry* b = sgrid.begin(cell); b != end; ++b) {
+            sz t2 = b->type;
             if(t2 >= n) continue;
             vec r_ba;
-            r_ba = adjusted_a_coords - b.coords; // FIXME why b-a and not a-b ?
+            r_ba = adjusted_a_coords - b->coords; // FIXME why b-a and not a-b ?
             fl r2 = sqr(r_ba);
             if(r2 < cutoff_sqr) {
-                sz type_pair_index = get_type_pair_index(p->atom_typing_used(), a, b);
+                sz type_pair_index = triangular_matrix_index_permissive(n, t1, t2);
                 pr e_dor =  p->eval_deriv(type_pair_index, r2);
                 this_e += e_dor.first;
                 deriv += e_dor.second * r_ba;
             }
         }
         curl(this_e, deriv, v);
-        m.minus_forces[i] = deriv + out_of_bounds_deriv;
+        m.minus_forces.set(i, deriv + out_of_bounds_deriv);
         e += this_e + out_of_bounds_penalty;
     }
     return e;
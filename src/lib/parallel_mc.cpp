@@ -20,7 +20,7 @@
 
 */
 
-#include "parallel.h"
+#include "thread_pool.h"
 #include "parallel_mc.h"
 #include "coords.h"
 #include "parallel_progress.h"
@@ -29,7 +29,9 @@ struct parallel_mc_task {
     model m;
     output_container out;
     rng generator;
-    parallel_mc_task(const model& m_, int seed) : m(m_), generator(static_cast<rng::result_type>(seed)) {}
+    unsigned steps_taken;
+    monte_carlo_chain chain; // with replica exchange, see parallel_mc::replicas
+    parallel_mc_task(const model& m_, int seed, fl temperature, sz lbfgs_history) : m(m_), generator(static_cast<rng::result_type>(seed)), steps_taken(0), chain(m_.get_size(), temperature, lbfgs_history) {}
 };
 
 typedef boost::ptr_vector<parallel_mc_task> parallel_mc_task_container;
@@ -43,13 +45,44 @@ struct parallel_mc_aux {
     const vec* corner1;
     const vec* corner2;
     parallel_progress* pg;
+    parallel_mc_task_container* tasks;
+    unsigned replica_steps; // with replica exchange, the steps of the chains until the next exchange; 0 to run the whole chains
     parallel_mc_aux(const monte_carlo* mc_, const precalculate* p_, const igrid* ig_, const precalculate* p_widened_, const igrid* ig_widened_, const vec* corner1_, const vec* corner2_, parallel_progress* pg_)
-        : mc(mc_), p(p_), ig(ig_), p_widened(p_widened_), ig_widened(ig_widened_), corner1(corner1_), corner2(corner2_), pg(pg_) {}
-    void operator()(parallel_mc_task& t) const {
-        (*mc)(t.m, t.out, *p, *ig, *p_widened, *ig_widened, *corner1, *corner2, pg, t.generator);
+        : mc(mc_), p(p_), ig(ig_), p_widened(p_widened_), ig_widened(ig_widened_), corner1(corner1_), corner2(corner2_), pg(pg_), tasks(NULL), replica_steps(0) {}
+    void operator()(sz i) const {
+        VINA_CHECK(tasks);
+        parallel_mc_task& t = (*tasks)[i];
+        if(replica_steps > 0) {
+            mc->run(t.m, t.out, t.chain, *p, *ig, replica_steps, pg, t.generator);
+            t.steps_taken = t.chain.steps_taken;
+        }
+        else
+            t.steps_taken = (*mc)(t.m, t.out, *p, *ig, *p_widened, *ig_widened, *corner1, *corner2, pg, t.generator);
     }
 };
 
+bool replicas_running(const monte_carlo& mc, const parallel_mc_task_container& tasks) {
+    VINA_FOR_IN(i, tasks)
+    if(!tasks[i].chain.stagnated && tasks[i].chain.steps_taken < mc.num_steps)
+        return true;
+    return false;
+}
+
+// swaps the current conformations of the neighbours at i and i+1 of each ladder, for the i of the given parity,
+// with the probability of the Metropolis criterion for the exchange
+void exchange_replicas(const parallel_mc& par, parallel_mc_task_container& tasks, sz parity, rng& generator) {
+    for(sz i = 0; i + 1 < tasks.size(); ++i) {
+        const sz rung = i % par.replicas;
+        if(rung % 2 != parity || rung + 1 == par.replicas) continue; // or i is the hottest of its ladder
+        monte_carlo_chain& a = tasks[i].chain;
+        monte_carlo_chain& b = tasks[i + 1].chain;
+        if(a.stagnated || b.stagnated) continue;
+        const fl exponent = (1 / a.temperature - 1 / b.temperature) * (a.current.e - b.current.e);
+        if(exponent >= 0 || random_fl(0, 1, generator) < std::exp(exponent))
+            std::swap(a.current, b.current);
+    }
+}
+
 void merge_output_containers(const output_container& in, output_container& out, fl min_rmsd, sz max_size) {
     VINA_FOR_IN(i, in)
     add_to_output_container(out, in[i], min_rmsd, max_size);
@@ -62,15 +95,42 @@ void merge_output_containers(const parallel_mc_task_container& many, output_cont
     out.sort();
 }
 
-void parallel_mc::operator()(const model& m, output_container& out, const precalculate& p, const igrid& ig, const precalculate& p_widened, const igrid& ig_widened, const vec& corner1, const vec& corner2, rng& generator) const {
+sz parallel_mc::operator()(const model& m, output_container& out, const precalculate& p, const igrid& ig, const precalculate& p_widened, const igrid& ig_widened, const vec& corner1, const vec& corner2, rng& generator) const {
     parallel_progress pp;
     parallel_mc_aux parallel_mc_aux_instance(&mc, &p, &ig, &p_widened, &ig_widened, &corner1, &corner2, (display_progress ? (&pp) : NULL));
     parallel_mc_task_container task_container;
     VINA_FOR(i, num_tasks)
-    task_container.push_back(new parallel_mc_task(m, random_int(0, 1000000, generator)));
+    task_container.push_back(new parallel_mc_task(m, random_int(0, 1000000, generator), replica_temperature(i), mc.lbfgs_history));
     if(display_progress)
         pp.init(num_tasks * mc.num_steps);
-    parallel_iter<parallel_mc_aux, parallel_mc_task_container, parallel_mc_task, true> parallel_iter_instance(&parallel_mc_aux_instance, num_threads);
-    parallel_iter_instance.run(task_container);
+    parallel_mc_aux_instance.tasks = &task_container;
+    if(replicas > 1) { // the chains run exchange_steps at a time, with the exchanges in between
+        VINA_FOR_IN(i, task_container)
+        mc.start(task_container[i].chain, corner1, corner2, task_container[i].generator);
+        rng exchange_generator(static_cast<rng::result_type>(random_int(0, 1000000, generator)));
+        parallel_mc_aux_instance.replica_steps = exchange_steps;
+        for(sz exchange = 0;; ++exchange) {
+            thread_pool::process_wide(num_threads).run(parallel_mc_aux_instance, task_container.size());
+            if(!replicas_running(mc, task_container))
+                break;
+            exchange_replicas(*this, task_container, exchange % 2, exchange_generator);
+        }
+        VINA_FOR_IN(i, task_container)
+        VINA_CHECK(!task_container[i].out.empty());
+    }
+    else
+        thread_pool::process_wide(num_threads).run(parallel_mc_aux_instance, task_container.size());
     merge_output_containers(task_container, out, mc.min_rmsd, mc.num_saved_mins);
+    sz steps_taken = 0;
+    VINA_FOR_IN(i, task_container)
+    steps_taken += task_container[i].steps_taken;
+    return steps_taken;
+}
+
+fl parallel_mc::replica_temperature(sz i) const {
+    const sz first = i - i % replicas; // of the ladder
+    const sz ladder_size = (std::min)(replicas, num_tasks - first);
+    if(ladder_size < 2)
+        return mc.temperature;
+    return mc.temperature * std::pow(max_temperature / mc.temperature, fl(i - first) / (ladder_size - 1));
 }
@@ -30,8 +30,14 @@ struct parallel_mc {
     sz num_tasks;
     sz num_threads;
     bool display_progress;
-    parallel_mc() : num_tasks(8), num_threads(1), display_progress(true) {}
-    void operator()(const model& m, output_container& out, const precalculate& p, const igrid& ig, const precalculate& p_widened, const igrid& ig_widened, const vec& corner1, const vec& corner2, rng& generator) const;
+    sz replicas; // with more than 1, each group of this many tasks is a replica exchange ladder, see replica_temperature
+    fl max_temperature; // of the hottest replica in a ladder
+    unsigned exchange_steps; // taken by each replica between the exchanges
+    parallel_mc() : num_tasks(8), num_threads(1), display_progress(true), replicas(1), max_temperature(2.4), exchange_steps(100) {}
+    // returns the number of Monte Carlo steps taken by all the tasks, see monte_carlo::stagnation_steps
+    sz operator()(const model& m, output_container& out, const precalculate& p, const igrid& ig, const precalculate& p_widened, const igrid& ig_widened, const vec& corner1, const vec& corner2, rng& generator) const;
+    // of task i: from mc.temperature for the first task of a ladder to max_temperature for the last one, in geometric progression
+    fl replica_temperature(sz i) const;
 };
 
 #endif
@@ -39,6 +39,12 @@ struct parallel_progress : public incrementable {
             ++(*p);
         }
     }
+    void increment(unsigned long n) {
+        if(p) {
+            boost::mutex::scoped_lock self_lk(self);
+            (*p) += n;
+        }
+    }
     virtual ~parallel_progress() {
         delete p;
     }
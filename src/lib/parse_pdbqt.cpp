@@ -403,24 +403,25 @@ void nr_update_matrixes(non_rigid_parsed& nr) {
     nr.inflex_inflex_bonds.resize(nr.inflex.size(), DISTANCE_FIXED); // FIXME?
 }
 
-template<typename B> // B == branch or main_branch or flexible_body
-void postprocess_branch(non_rigid_parsed& nr, parsing_struct& p, context& c, B& b) {
-    b.node.begin = nr.atoms.size();
-    VINA_FOR_IN(i, p.atoms) {  // postprocess atoms into 'b.node'
+template<typename T> // T == main_branch or ligand
+void postprocess_branch(non_rigid_parsed& nr, parsing_struct& p, context& c, T& t, sz n) { // n: heterotree_node or the segment of t being filled
+    atom_frame& b = t.frame_of(n); // valid until segments are added
+    b.begin = nr.atoms.size();
+    VINA_FOR_IN(i, p.atoms) {  // postprocess atoms into 'b'
         parsing_struct::node& p_node = p.atoms[i];
         if(p.immobile_atom && i == p.immobile_atom.get()) {} // skip immobile_atom - it's already inserted in "THERE"
-        else p_node.insert(nr, c, b.node.get_origin());
-        p_node.insert_immobiles(nr, c, b.node.get_origin());
+        else p_node.insert(nr, c, b.get_origin());
+        p_node.insert_immobiles(nr, c, b.get_origin());
     }
-    b.node.end = nr.atoms.size();
+    b.end = nr.atoms.size();
 
     nr_update_matrixes(nr);
-    add_bonds(nr, p.axis_begin, b.node); // b.node is used as atom_range
-    add_bonds(nr, p.axis_end  , b.node); // b.node is used as atom_range
+    add_bonds(nr, p.axis_begin, b); // b is used as atom_range
+    add_bonds(nr, p.axis_end  , b); // b is used as atom_range
     set_rotor(nr, p.axis_begin, p.axis_end);
 
-    VINA_RANGE(i, b.node.begin, b.node.end)
-    VINA_RANGE(j, i+1, b.node.end)
+    VINA_RANGE(i, b.begin, b.end)
+    VINA_RANGE(j, i+1, b.end)
     nr.atoms_atoms_bonds(i, j) = DISTANCE_FIXED; // FIXME
 
 
@@ -429,8 +430,9 @@ void postprocess_branch(non_rigid_parsed& nr, parsing_struct& p, context& c, B&
         VINA_FOR_IN(j, p_node.ps) {
             parsing_struct& ps = p_node.ps[j];
             if(!ps.essentially_empty()) { // immobile already inserted // FIXME ?!
-                b.children.push_back(segment(ps.immobile_atom_coords(), 0, 0, p_node.a.coords, b.node)); // postprocess_branch will assign begin and end
-                postprocess_branch(nr, ps, c, b.children.back());
+                sz child = t.add_segment(segment(ps.immobile_atom_coords(), 0, 0, p_node.a.coords, t.frame_of(n)), n); // postprocess_branch will assign begin and end
+                postprocess_branch(nr, ps, c, t, child);
+                t.end_segment(child);
             }
         }
     }
@@ -442,7 +444,7 @@ void postprocess_branch(non_rigid_parsed& nr, parsing_struct& p, context& c, B&
 void postprocess_ligand(non_rigid_parsed& nr, parsing_struct& p, context& c, unsigned torsdof) {
     VINA_CHECK(!p.atoms.empty());
     nr.ligands.push_back(ligand(flexible_body(rigid_body(p.atoms[0].a.coords, 0, 0)), torsdof)); // postprocess_branch will assign begin and end
-    postprocess_branch(nr, p, c, nr.ligands.back());
+    postprocess_branch(nr, p, c, nr.ligands.back(), heterotree_node);
     nr_update_matrixes(nr); // FIXME ?
 }
 
@@ -458,7 +460,7 @@ void postprocess_residue(non_rigid_parsed& nr, parsing_struct& p, context& c) {
             parsing_struct& ps = p_node.ps[j];
             if(!ps.essentially_empty()) { // immobile atom already inserted // FIXME ?!
                 nr.flex.push_back(main_branch(first_segment(ps.immobile_atom_coords(), 0, 0, p_node.a.coords))); // postprocess_branch will assign begin and end
-                postprocess_branch(nr, ps, c, nr.flex.back());
+                postprocess_branch(nr, ps, c, nr.flex.back(), heterotree_node);
             }
         }
     }
@@ -565,8 +567,8 @@ void parse_pdbqt_branch(std::istream& in, unsigned& count, parsing_struct& p, co
 struct pdbqt_initializer {
     model m;
     void initialize_from_rigid(const rigid& r) { // static really
-        VINA_CHECK(m.grid_atoms.empty());
-        m.grid_atoms = r.atoms;
+        VINA_CHECK(m.grid_atoms().empty());
+        m.mutable_receptor().grid_atoms = r.atoms;
     }
     void initialize_from_nrp(const non_rigid_parsed& nrp, const context& c, bool is_ligand) { // static really
         VINA_CHECK(m.ligands.empty());
@@ -607,7 +609,7 @@ struct pdbqt_initializer {
             m.ligands.front().cont = c;
         }
         else
-            m.flex_context = c;
+            m.mutable_receptor().flex_context = c;
 
     }
     void initialize(const distance_type_matrix& mobility) {
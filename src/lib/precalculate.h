@@ -113,6 +113,8 @@ struct precalculate {
         m_cutoff_sqr(sqr(sf.cutoff())),
         n(sz(factor_ * m_cutoff_sqr) + 3),  // sz(factor * r^2) + 1 <= sz(factor * cutoff_sqr) + 2 <= n-1 < n  // see assert below
         factor(factor_),
+        m_compact_factor(factor_),
+        m_compact_n(0),
 
         data(num_atom_types(sf.atom_typing_used()), precalculate_element(n, factor_)),
         m_atom_typing_used(sf.atom_typing_used()) {
@@ -136,12 +138,48 @@ struct precalculate {
     }
     fl eval_fast(sz type_pair_index, fl r2) const {
         assert(r2 <= m_cutoff_sqr);
+        if(!m_compact_offsets.empty() && m_compact_offsets[type_pair_index] != not_compact) {
+            const float* p = compact_entry(type_pair_index, r2);
+            return (fl(p[0]) + fl(p[2])) / 2; // as fast[] is made from smooth[].first
+        }
         return data(type_pair_index).eval_fast(r2);
     }
     pr eval_deriv(sz type_pair_index, fl r2) const {
         assert(r2 <= m_cutoff_sqr);
+        if(!m_compact_offsets.empty() && m_compact_offsets[type_pair_index] != not_compact) {
+            const fl r2_factored = m_compact_factor * r2;
+            const float* p = compact_entry(type_pair_index, r2); // e and dor at i1, then at i2, contiguous
+            const fl rem = r2_factored - sz(r2_factored);
+            return pr(p[0] + rem * (p[2] - p[0]), p[1] + rem * (p[3] - p[1]));
+        }
         return data(type_pair_index).eval_deriv(r2);
     }
+    // Compact mode: the type pairs given (typically those of the ligand with itself and with the
+    // receptor) get a copy of their smooth table in float, (e, dor) interleaved and sampled at
+    // factor_ instead of table_factor(), small enough to stay in cache. eval_fast and eval_deriv use it
+    // for those pairs; grid population keeps using the full tables.
+    void compact(const szv& type_pair_indexes, fl factor_) {
+        VINA_CHECK(factor_ > epsilon_fl);
+        m_compact_factor = factor_;
+        m_compact_n = sz(factor_ * m_cutoff_sqr) + 3; // as n
+        m_compact_offsets.assign(data.dim() * (data.dim() + 1) / 2, sz(not_compact));
+        m_compact.clear();
+        VINA_FOR_IN(i, type_pair_indexes) {
+            const sz type_pair_index = type_pair_indexes[i];
+            if(m_compact_offsets[type_pair_index] != not_compact) continue;
+            m_compact_offsets[type_pair_index] = m_compact.size();
+            fill_compact(type_pair_index);
+        }
+    }
+    bool compacted() const {
+        return !m_compact_offsets.empty();
+    }
+    sz compact_bytes() const {
+        return m_compact.size() * sizeof(float);
+    }
+    sz table_bytes(sz num_type_pairs) const { // of the smooth tables that eval_deriv reads for that many pairs in the full layout
+        return num_type_pairs * n * sizeof(pr);
+    }
     sz index_permissive(sz t1, sz t2) const {
         return data.index_permissive(t1, t2);
     }
@@ -151,13 +189,42 @@ struct precalculate {
     fl cutoff_sqr() const {
         return m_cutoff_sqr;
     }
+    // raw access for kernels that look up several type pairs at the same r2; the index into fast_table is sz(table_factor() * r2)
+    const flv& fast_table(sz type_pair_index) const {
+        return data(type_pair_index).fast;
+    }
+    fl table_factor() const {
+        return factor;
+    }
     void widen(fl left, fl right) {
         flv rs = calculate_rs();
         VINA_FOR(t1, data.dim())
         VINA_RANGE(t2, t1, data.dim())
         data(t1, t2).widen(rs, left, right);
+        if(compacted()) { // refresh the compact tables
+            szv type_pair_indexes;
+            VINA_FOR_IN(i, m_compact_offsets)
+            if(m_compact_offsets[i] != not_compact)
+                type_pair_indexes.push_back(i);
+            compact(type_pair_indexes, m_compact_factor);
+        }
     }
 private:
+    static const sz not_compact = sz(-1);
+    const float* compact_entry(sz type_pair_index, fl r2) const {
+        const sz i1 = sz(m_compact_factor * r2);
+        assert(i1 + 1 < m_compact_n);
+        return &m_compact[m_compact_offsets[type_pair_index] + 2 * i1];
+    }
+    void fill_compact(sz type_pair_index) { // appends the compact table of the pair to m_compact
+        const precalculate_element& p = data(type_pair_index);
+        const fl max_r2 = (n - 2) / factor; // the last r2 that p.eval_deriv can interpolate at
+        VINA_FOR(i, m_compact_n) {
+            const pr e_dor = p.eval_deriv((std::min)(i / m_compact_factor, max_r2)); // exact where i / m_compact_factor falls on the full table
+            m_compact.push_back(float(e_dor.first));
+            m_compact.push_back(float(e_dor.second));
+        }
+    }
     flv calculate_rs() const {
         flv tmp(n, 0);
         VINA_FOR(i, n)
@@ -167,9 +234,13 @@ private:
     fl m_cutoff_sqr;
     sz n;
     fl factor;
+    fl m_compact_factor;
+    sz m_compact_n;
     atom_type::t m_atom_typing_used;
 
     triangular_matrix<precalculate_element> data;
+    std::vector<float> m_compact; // see compact
+    szv m_compact_offsets; // into m_compact, by type pair index; empty unless compact was called
 };
 
 #endif
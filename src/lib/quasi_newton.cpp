@@ -36,8 +36,15 @@ struct quasi_newton_aux {
 };
 
 void quasi_newton::operator()(model& m, const precalculate& p, const igrid& ig, output_type& out, change& g, const vec& v) const { // g must have correct size
+    quasi_newton_workspace w(workspace(out.c, g));
+    operator()(m, p, ig, out, g, v, w);
+}
+
+void quasi_newton::operator()(model& m, const precalculate& p, const igrid& ig, output_type& out, change& g, const vec& v, quasi_newton_workspace& w) const {
+    assert(w.history.capacity == lbfgs_history);
     quasi_newton_aux aux(&m, &p, &ig, v);
-    fl res = bfgs(aux, out.c, g, max_steps, average_required_improvement, 10);
+    fl res = (lbfgs_history > 0) ? lbfgs(aux, out.c, g, max_steps, w)
+                                 : bfgs(aux, out.c, g, max_steps, average_required_improvement, 10, w);
     out.e = res;
 }
 
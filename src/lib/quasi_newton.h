@@ -24,13 +24,21 @@
 #define VINA_QUASI_NEWTON_H
 
 #include "model.h"
+#include "bfgs.h"
+
+typedef bfgs_workspace<conf, change> quasi_newton_workspace;
 
 struct quasi_newton {
     unsigned max_steps;
     fl average_required_improvement;
-    quasi_newton() : max_steps(1000), average_required_improvement(0.0) {}
+    sz lbfgs_history; // if not 0, lbfgs with this many steps instead of bfgs
+    quasi_newton() : max_steps(1000), average_required_improvement(0.0), lbfgs_history(0) {}
     // clean up
     void operator()(model& m, const precalculate& p, const igrid& ig, output_type& out, change& g, const vec& v) const; // g must have correct size
+    void operator()(model& m, const precalculate& p, const igrid& ig, output_type& out, change& g, const vec& v, quasi_newton_workspace& w) const; // w from workspace, for the sizes of out.c and g
+    quasi_newton_workspace workspace(const conf& c, const change& g) const {
+        return quasi_newton_workspace(c, g, lbfgs_history);
+    }
 };
 
 #endif
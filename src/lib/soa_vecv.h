@@ -0,0 +1,143 @@
+/*
+
+   Copyright (c) 2006-2010, The Scripps Research Institute
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+   Author: Dr. Oleg Trott <ot14@columbia.edu>,
+           The Olson Lab,
+           The Scripps Research Institute
+
+*/
+
+#ifndef VINA_SOA_VECV_H
+#define VINA_SOA_VECV_H
+
+#include <algorithm> // copy, fill, min, swap
+#include "common.h"
+
+// A vecv stored as structure of arrays: the x, y and z components each in an
+// array that starts on a 32 byte boundary, so that kernels can load or store 4
+// consecutive elements with one AVX instruction. Elements are read by value
+// and written with set, add and sub.
+class soa_vecv {
+    sz m_size;
+    sz m_capacity; // also the distance between the component arrays, a multiple of 4
+    fl* m_buffer;
+    fl* m_data; // m_buffer, aligned
+    void reallocate(sz capacity) {
+        fl* buffer = new fl[3 * capacity + 4];
+        fl* data = reinterpret_cast<fl*>((reinterpret_cast<std::size_t>(buffer) + 31) / 32 * 32);
+        VINA_FOR(d, 3)
+        std::copy(component(d), component(d) + m_size, data + d * capacity);
+        delete[] m_buffer;
+        m_buffer = buffer;
+        m_data = data;
+        m_capacity = capacity;
+    }
+    fl* component(sz d) const {
+        return m_data + d * m_capacity;
+    }
+public:
+    soa_vecv() : m_size(0), m_capacity(0), m_buffer(NULL), m_data(NULL) {}
+    explicit soa_vecv(const vecv& v) : m_size(0), m_capacity(0), m_buffer(NULL), m_data(NULL) {
+        resize(v.size());
+        VINA_FOR_IN(i, v)
+        set(i, v[i]);
+    }
+    soa_vecv(const soa_vecv& other) : m_size(0), m_capacity(0), m_buffer(NULL), m_data(NULL) {
+        *this = other;
+    }
+    soa_vecv& operator=(const soa_vecv& other) {
+        if(this == &other) return *this;
+        if(other.m_size > m_capacity)
+            reallocate((other.m_size + 3) / 4 * 4);
+        m_size = other.m_size;
+        VINA_FOR(d, 3)
+        std::copy(other.data(d), other.data(d) + m_size, component(d));
+        return *this;
+    }
+    ~soa_vecv() {
+        delete[] m_buffer;
+    }
+    void swap(soa_vecv& other) {
+        std::swap(m_size, other.m_size);
+        std::swap(m_capacity, other.m_capacity);
+        std::swap(m_buffer, other.m_buffer);
+        std::swap(m_data, other.m_data);
+    }
+    sz size() const {
+        return m_size;
+    }
+    bool empty() const {
+        return m_size == 0;
+    }
+    void reserve(sz n) {
+        if(n > m_capacity)
+            reallocate((n + 3) / 4 * 4);
+    }
+    void resize(sz n, const vec& v = zero_vec) { // new elements are v
+        reserve(n);
+        const sz old_size = m_size;
+        m_size = n;
+        VINA_RANGE(i, old_size, n)
+        set(i, v);
+    }
+    void push_back(const vec& v) {
+        if(m_size == m_capacity)
+            reallocate((std::max)(sz(4), 2 * m_capacity));
+        set(m_size++, v);
+    }
+    void assign(const vec& v) { // to every element
+        VINA_FOR(d, 3)
+        std::fill(component(d), component(d) + m_size, v[d]);
+    }
+    vec operator[](sz i) const {
+        assert(i < m_size);
+        return vec(m_data[i], m_data[m_capacity + i], m_data[2 * m_capacity + i]);
+    }
+    void set(sz i, const vec& v) {
+        assert(i < m_size);
+        m_data[i] = v[0];
+        m_data[m_capacity + i] = v[1];
+        m_data[2 * m_capacity + i] = v[2];
+    }
+    void add(sz i, const vec& v) {
+        assert(i < m_size);
+        m_data[i] += v[0];
+        m_data[m_capacity + i] += v[1];
+        m_data[2 * m_capacity + i] += v[2];
+    }
+    void sub(sz i, const vec& v) {
+        assert(i < m_size);
+        m_data[i] -= v[0];
+        m_data[m_capacity + i] -= v[1];
+        m_data[2 * m_capacity + i] -= v[2];
+    }
+    const fl* data(sz d) const { // component d of all the elements, 32 byte aligned
+        assert(d < 3);
+        return component(d);
+    }
+    fl* data(sz d) {
+        assert(d < 3);
+        return component(d);
+    }
+    vecv to_vecv() const {
+        vecv tmp(m_size);
+        VINA_FOR(i, m_size)
+        tmp[i] = (*this)[i];
+        return tmp;
+    }
+};
+
+#endif
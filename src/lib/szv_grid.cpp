@@ -20,65 +20,83 @@
 
 */
 
+#include <algorithm> // max
 #include "szv_grid.h"
+#include "array3d.h" // checked_multiply
 #include "brick.h"
 
-szv_grid::szv_grid(const model& m, const grid_dims& gd, fl cutoff_sqr) : m_data(gd[0].n, gd[1].n, gd[2].n) {
+szv_grid::szv_grid(const model& m, const grid_dims& gd, fl cutoff_sqr) {
     vec end;
     VINA_FOR_IN(i, gd) {
         m_init[i] = gd[i].begin;
         end   [i] = gd[i].end;
+        m_dim [i] = gd[i].n;
     }
     m_range = end - m_init;
+    const sz num_cells = checked_multiply(m_dim[0], m_dim[1], m_dim[2]);
 
-    const sz nat = num_atom_types(m.atom_typing_used());
+    const atom_type::t atu = m.atom_typing_used();
+    const sz nat = num_atom_types(atu);
+    const fl cutoff = std::sqrt(cutoff_sqr);
 
-    szv relevant_indexes;
-    VINA_FOR_IN(i, m.grid_atoms) {
-        const atom& a = m.grid_atoms[i];
-        if(a.get(m.atom_typing_used()) < nat && brick_distance_sqr(m_init, end, a.coords) < cutoff_sqr)
-            relevant_indexes.push_back(i);
+    // binning: each atom is tested against the cells of its bounding box only; cells that
+    // the box grazes are excluded by the same brick test as before, so the cells hold the same atoms
+    szv cells; // pairs of (cell, atom), in atom order
+    VINA_FOR_IN(i, m.grid_atoms()) {
+        const atom& a = m.grid_atoms()[i];
+        if(a.get(atu) >= nat || brick_distance_sqr(m_init, end, a.coords) >= cutoff_sqr) continue;
+        sz lo[3], hi[3];
+        VINA_FOR(n, 3) { // one cell of slack on each side for rounding
+            const fl low  = (std::max)(fl(0), (a.coords[n] - cutoff - m_init[n]) * m_dim[n] / m_range[n]);
+            const fl high = (std::max)(fl(0), (a.coords[n] + cutoff - m_init[n]) * m_dim[n] / m_range[n]);
+            lo[n] = (low < 1) ? 0 : sz(low) - 1;
+            hi[n] = (high + 2 > m_dim[n]) ? m_dim[n] : sz(high) + 2;
+        }
+        for(sz z = lo[2]; z < hi[2]; ++z)
+            for(sz y = lo[1]; y < hi[1]; ++y)
+                for(sz x = lo[0]; x < hi[0]; ++x) {
+                    const vec cell_begin(index_to_coord(0, x),   index_to_coord(1, y),   index_to_coord(2, z));
+                    const vec cell_end  (index_to_coord(0, x+1), index_to_coord(1, y+1), index_to_coord(2, z+1));
+                    if(brick_distance_sqr(cell_begin, cell_end, a.coords) < cutoff_sqr) {
+                        cells.push_back(x + m_dim[0] * (y + m_dim[1] * z));
+                        cells.push_back(i);
+                    }
+                }
     }
 
-    VINA_FOR(x, m_data.dim0())
-    VINA_FOR(y, m_data.dim1())
-    VINA_FOR(z, m_data.dim2()) {
-        VINA_FOR_IN(ri, relevant_indexes) {
-            const sz i = relevant_indexes[ri];
-            const atom& a = m.grid_atoms[i];
-            if(brick_distance_sqr(index_to_coord(x, y, z), index_to_coord(x+1, y+1, z+1), a.coords) < cutoff_sqr)
-                m_data(x, y, z).push_back(i);
-        }
+    // counting sort by cell, stable, so that each cell lists its atoms in increasing order
+    m_begin.assign(num_cells + 1, 0);
+    for(sz k = 0; k < cells.size(); k += 2)
+        ++m_begin[cells[k] + 1];
+    VINA_FOR(i, num_cells)
+    m_begin[i + 1] += m_begin[i];
+    szv next(m_begin.begin(), m_begin.end() - 1);
+    m_entries.resize(cells.size() / 2);
+    for(sz k = 0; k < cells.size(); k += 2) {
+        const atom& a = m.grid_atoms()[cells[k + 1]];
+        entry& e = m_entries[next[cells[k]]++];
+        e.coords = a.coords;
+        e.type = a.get(atu);
     }
 }
 
 fl szv_grid::average_num_possibilities() const {
-    sz counter = 0;
-    VINA_FOR(x, m_data.dim0())
-    VINA_FOR(y, m_data.dim1())
-    VINA_FOR(z, m_data.dim2()) {
-        counter += m_data(x, y, z).size();
-    }
-    return fl(counter) / (m_data.dim0() * m_data.dim1() * m_data.dim2());
+    return fl(m_entries.size()) / num_cells();
 }
 
-const szv& szv_grid::possibilities(const vec& coords) const {
+sz szv_grid::cell_index(const vec& coords) const {
     boost::array<sz, 3> index;
     VINA_FOR_IN(i, index) {
         assert(coords[i] + epsilon_fl >= m_init[i]);
         assert(coords[i] <= m_init[i] + m_range[i] + epsilon_fl);
-        const fl tmp = (coords[i] - m_init[i]) * m_data.dim(i) / m_range[i];
-        index[i] = fl_to_sz(tmp, m_data.dim(i) - 1);
+        const fl tmp = (coords[i] - m_init[i]) * m_dim[i] / m_range[i];
+        index[i] = fl_to_sz(tmp, m_dim[i] - 1);
     }
-    return m_data(index[0], index[1], index[2]);
+    return index[0] + m_dim[0] * (index[1] + m_dim[1] * index[2]);
 }
 
-vec szv_grid::index_to_coord(sz i, sz j, sz k) const {
-    vec index(i, j, k);
-    vec tmp;
-    VINA_FOR_IN(n, tmp)
-    tmp[n] = m_init[n] + m_range[n] * index[n] / m_data.dim(n);
-    return tmp;
+fl szv_grid::index_to_coord(sz n, sz i) const {
+    return m_init[n] + m_range[n] * i / m_dim[n];
 }
 
 grid_dims szv_grid_dims(const grid_dims& gd) {
@@ -25,17 +25,34 @@
 
 #include "model.h"
 #include "grid_dim.h"
-#include "array3d.h"
 
+// Cell list of the receptor atoms within the cutoff of each (about 3A) cell,
+// stored compressed: the entries of cell i are [begin(i), end(i)) in one
+// packed array, so that scanning the neighbours of a point is sequential.
 struct szv_grid {
+    struct entry { // a receptor atom, as needed by the pair terms
+        vec coords;
+        sz type; // in m.atom_typing_used(), always < num_atom_types
+    };
     szv_grid(const model& m, const grid_dims& gd, fl cutoff_sqr);
-    const szv& possibilities(const vec& coords) const;
+    sz cell_index(const vec& coords) const; // flattened index of the cell containing coords
+    sz num_cells() const {
+        return m_begin.size() - 1;
+    }
+    const entry* begin(sz cell) const {
+        return m_entries.empty() ? NULL : &m_entries[0] + m_begin[cell];
+    }
+    const entry* end(sz cell) const {
+        return m_entries.empty() ? NULL : &m_entries[0] + m_begin[cell + 1];
+    }
     fl average_num_possibilities() const;
 private:
-    array3d<szv> m_data;
+    szv m_begin; // cell i holds m_entries[m_begin[i], m_begin[i+1])
+    std::vector<entry> m_entries;
+    sz m_dim[3]; // number of cells along each axis
     vec m_init;
     vec m_range;
-    vec index_to_coord(sz i, sz j, sz k) const;
+    fl index_to_coord(sz n, sz i) const; // of the lower boundary of cells i along axis n
 };
 
 grid_dims szv_grid_dims(const grid_dims& gd);
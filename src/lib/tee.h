@@ -28,7 +28,8 @@
 
 struct tee {
     ofile* of;
-    tee() : of(NULL) {}
+    std::ostream* screen; // std::cout, or a buffer for output that is printed later
+    tee() : of(NULL), screen(&std::cout) {}
     void init(const path& name) {
         of = new ofile(name);
     }
@@ -36,22 +37,22 @@ struct tee {
         delete of;
     }
     void flush() {
-        std::cout << std::flush;
+        (*screen) << std::flush;
         if(of)
             (*of) << std::flush;
     }
     void endl() {
-        std::cout << std::endl;
+        (*screen) << std::endl;
         if(of)
             (*of) << std::endl;
     }
     void setf(std::ios::fmtflags a) {
-        std::cout.setf(a);
+        screen->setf(a);
         if(of)
             of->setf(a);
     }
     void setf(std::ios::fmtflags a, std::ios::fmtflags b) {
-        std::cout.setf(a, b);
+        screen->setf(a, b);
         if(of)
             of->setf(a, b);
     }
@@ -59,7 +60,7 @@ struct tee {
 
 template<typename T>
 tee& operator<<(tee& out, const T& x) {
-    std::cout << x;
+    (*out.screen) << x;
     if(out.of)
         (*out.of) << x;
     return out;
@@ -195,15 +195,15 @@ flv terms::evale(const model& m) const {
     vec box_end   = grid_dims_end  (box);
 
     szv relevant_atoms;
-    VINA_FOR_IN(j, m.grid_atoms)
-    if(brick_distance_sqr(box_begin, box_end, m.grid_atoms[j].coords) < max_r_cutoff_sqr)
+    VINA_FOR_IN(j, m.grid_atoms())
+    if(brick_distance_sqr(box_begin, box_end, m.grid_atoms()[j].coords) < max_r_cutoff_sqr)
         relevant_atoms.push_back(j);
 
     VINA_FOR(i, m.num_movable_atoms()) {
         const vec& coords = m.coords[i];
         VINA_FOR_IN(relevant_j, relevant_atoms) {
             const sz j = relevant_atoms[relevant_j];
-            const atom& b = m.grid_atoms[j];
+            const atom& b = m.grid_atoms()[j];
             fl d2 = vec_distance_sqr(coords, b.coords);
             if(d2 > max_r_cutoff_sqr) continue; // most likely scenario
             fl d = std::sqrt(d2);
@@ -251,8 +251,8 @@ flv terms::evale_robust(const model& m) const {
 
     std::vector<atom_index> relevant_atoms;
 
-    VINA_FOR_IN(j, m.grid_atoms) {
-        const atom& a = m.grid_atoms[j];
+    VINA_FOR_IN(j, m.grid_atoms()) {
+        const atom& a = m.grid_atoms()[j];
         const sz t = a.get(m.atom_typing_used());
         if(brick_distance_sqr(box_begin, box_end, a.coords) < max_r_cutoff_sqr && t < n) // exclude, say, Hydrogens
             relevant_atoms.push_back(atom_index(j, true));
@@ -0,0 +1,211 @@
+/*
+
+   Copyright (c) 2006-2010, The Scripps Research Institute
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+   Author: Dr. Oleg Trott <ot14@columbia.edu>,
+           The Olson Lab,
+           The Scripps Research Institute
+
+*/
+
+#include "thread_pool.h"
+#include "my_pid.h"
+
+struct thread_pool::batch {
+    const job& j;
+    boost::atomic<sz> remaining; // calls not finished
+    boost::mutex m;
+    boost::condition finished;
+    bool done; // remaining reached 0; read and written under m, so that the batch outlives the last notify
+    bool failed; // a call threw
+    bool nesting; // see run
+    batch(const job& j_, sz size, bool nesting_) : j(j_), remaining(size), done(false), failed(false), nesting(nesting_) {}
+    bool may_be_taken(const batch* waiting) const {
+        return !waiting || !nesting || this == waiting;
+    }
+};
+
+thread_pool::thread_pool(sz num_threads) : queued(0), events(0), stopping(false) {
+    VINA_CHECK(num_threads > 0);
+    VINA_FOR(i, num_threads - 1)
+    deques.push_back(new worker_deque);
+    VINA_FOR_IN(i, deques)
+    workers.create_thread(worker_aux(this, i));
+}
+
+thread_pool::~thread_pool() {
+    {
+        boost::mutex::scoped_lock lk(idle_m);
+        stopping = true;
+        idle.notify_all(); // stopping modified
+    }
+    workers.join_all();
+}
+
+void thread_pool::run_job(const job& j, sz size, bool nesting) {
+    if(size == 0) return;
+    batch b(j, size, nesting);
+    const sz n = deques.size();
+    const sz* own = own_deque.get();
+    const sz own_index = own ? *own : n;
+    if(n == 0) {
+        VINA_FOR(i, size)
+        execute(task(&b, i));
+    }
+    else {
+        queued += size; // before they can be taken
+        if(own_index < n) { // in the order the owner takes them
+            boost::mutex::scoped_lock lk(deques[own_index].m);
+            VINA_FOR(i, size)
+            deques[own_index].tasks.push_back(task(&b, size - i - 1));
+        }
+        else { // dealt out round robin, the calling thread steals too
+            VINA_FOR(d, (std::min)(n, size)) {
+                boost::mutex::scoped_lock lk(deques[d].m);
+                for(sz i = d; i < size; i += n)
+                    deques[d].tasks.push_back(task(&b, i));
+            }
+        }
+        {
+            boost::mutex::scoped_lock lk(idle_m);
+            ++events;
+            idle.notify_all(); // queued modified
+            progress.notify_all();
+        }
+        task t;
+        while(b.remaining.load() > 0) {
+            const sz seen = events.load(); // before take, so that the tasks queued after it are not missed
+            if(take(own_index, &b, t))
+                execute(t); // perhaps of another batch
+            else { // the remaining calls are running elsewhere; those may queue tasks
+                boost::mutex::scoped_lock lk(idle_m);
+                while(b.remaining.load() > 0 && events.load() == seen)
+                    progress.wait(lk);
+            }
+        }
+    }
+    boost::mutex::scoped_lock lk(b.m);
+    while(!b.done)
+        b.finished.wait(lk);
+    VINA_CHECK(!b.failed);
+}
+
+void thread_pool::work(sz w) {
+    own_deque.reset(new sz(w));
+    task t;
+    while(true) {
+        if(take(w, NULL, t)) {
+            execute(t);
+            continue;
+        }
+        boost::mutex::scoped_lock lk(idle_m);
+        while(!stopping && queued.load() == 0)
+            idle.wait(lk);
+        if(stopping) return;
+    }
+}
+
+bool thread_pool::take(sz own, const batch* waiting, task& t) {
+    const sz n = deques.size();
+    if(own < n) {
+        worker_deque& d = deques[own];
+        boost::mutex::scoped_lock lk(d.m);
+        for(sz k = d.tasks.size(); k > 0; --k) {
+            if(!d.tasks[k - 1].b->may_be_taken(waiting)) continue;
+            t = d.tasks[k - 1];
+            d.tasks.erase(d.tasks.begin() + (k - 1));
+            --queued;
+            return true;
+        }
+    }
+    VINA_FOR(k, n) {
+        const sz i = (own + 1 + k) % n; // starting with the next one, so that the thieves spread out
+        if(i == own) continue;
+        worker_deque& d = deques[i];
+        boost::mutex::scoped_lock lk(d.m);
+        VINA_FOR_IN(l, d.tasks) {
+            if(!d.tasks[l].b->may_be_taken(waiting)) continue;
+            t = d.tasks[l];
+            d.tasks.erase(d.tasks.begin() + l);
+            --queued;
+            return true;
+        }
+    }
+    return false;
+}
+
+void thread_pool::execute(const task& t) {
+    batch& b = *t.b;
+    bool ok = true;
+    try {
+        b.j(t.i);
+    }
+    catch(...) { // would end the process on a worker; the caller of run fails instead
+        ok = false;
+    }
+    if(!ok) {
+        boost::mutex::scoped_lock lk(b.m);
+        b.failed = true;
+    }
+    if(--b.remaining == 0) {
+        {
+            boost::mutex::scoped_lock lk(idle_m); // wakes up the caller of run if it waits for progress
+            ++events;
+            progress.notify_all();
+        }
+        boost::mutex::scoped_lock lk(b.m);
+        b.done = true;
+        b.finished.notify_all();
+    }
+}
+
+namespace {
+struct process_wide_pool {
+    thread_pool* pool;
+    int pid; // of the process that made it
+    process_wide_pool() : pool(NULL), pid(0) {}
+    ~process_wide_pool() {
+        if(pool && pid == my_pid())
+            delete pool;
+    }
+};
+
+process_wide_pool& the_process_wide_pool() {
+    static process_wide_pool p; // the first call is made before there are other threads
+    return p;
+}
+}
+
+thread_pool& thread_pool::process_wide(sz num_threads) {
+    process_wide_pool& p = the_process_wide_pool();
+    if(p.pool && (p.pid != my_pid() || p.pool->num_threads() != num_threads)) {
+        if(p.pid == my_pid())
+            delete p.pool;
+        // else it is left as it is: its workers are in the parent, and joining them here would hang
+        p.pool = NULL;
+    }
+    if(!p.pool) {
+        p.pool = new thread_pool(num_threads);
+        p.pid = my_pid();
+    }
+    return *p.pool;
+}
+
+void thread_pool::shutdown_process_wide() {
+    process_wide_pool& p = the_process_wide_pool();
+    if(p.pool && p.pid == my_pid())
+        delete p.pool; // must not be running anything
+    p.pool = NULL;
+}
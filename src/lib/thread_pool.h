@@ -0,0 +1,112 @@
+/*
+
+   Copyright (c) 2006-2010, The Scripps Research Institute
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+   Author: Dr. Oleg Trott <ot14@columbia.edu>,
+           The Olson Lab,
+           The Scripps Research Institute
+
+*/
+
+#ifndef VINA_THREAD_POOL_H
+#define VINA_THREAD_POOL_H
+
+#include <deque>
+
+#include <boost/atomic.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/utility.hpp> // noncopyable
+
+#include "common.h"
+
+// Threads that live as long as the pool, each with its own deque of tasks. run spreads the calls of
+// one job over the deques and works on them in the calling thread too; a thread whose deque is empty
+// steals from the front of the others. Taking a task locks only the deque it is in, so the threads
+// share no lock while there is work; the pool's own mutex is taken only to wake up idle threads.
+//
+// run may be called by a task (the new tasks then go to the calling worker's deque), and from several
+// threads at once. A thread waiting in run works on any task meanwhile, except on those of a nesting run
+// other than its own: the calls of those run tasks of their own and take long, and the wait would last
+// until such a call returned.
+class thread_pool : boost::noncopyable {
+public:
+    explicit thread_pool(sz num_threads); // num_threads - 1 workers, besides the thread calling run
+    ~thread_pool(); // must not be running anything
+    sz num_threads() const { return deques.size() + 1; }
+
+    // f(i) for i in [0, size), in any order and on any of the threads; returns when all have returned
+    template<typename F>
+    void run(const F& f, sz size, bool nesting = false) {
+        job_of<F> j(f);
+        run_job(j, size, nesting);
+    }
+
+    // the pool shared by the whole process, made on first use; made again for a different number of
+    // threads, or in a child after fork, whose workers were not copied
+    static thread_pool& process_wide(sz num_threads);
+    // joins the workers of the process-wide pool, if any; to be called before fork, so that the children
+    // do not inherit locks held by threads they do not have. The next process_wide makes a new pool
+    static void shutdown_process_wide();
+private:
+    struct job {
+        virtual void operator()(sz i) const = 0;
+        virtual ~job() {}
+    };
+    template<typename F>
+    struct job_of : public job {
+        const F& f; // does not keep a local copy!
+        job_of(const F& f_) : f(f_) {}
+        void operator()(sz i) const { f(i); }
+    };
+    struct batch; // one call of run
+    struct task {
+        batch* b;
+        sz i;
+        task() : b(NULL), i(0) {}
+        task(batch* b_, sz i_) : b(b_), i(i_) {}
+    };
+    struct worker_deque {
+        boost::mutex m;
+        std::deque<task> tasks; // the owner takes from the back, the thieves from the front
+    };
+    struct worker_aux {
+        thread_pool* pool;
+        sz w;
+        worker_aux(thread_pool* pool_, sz w_) : pool(pool_), w(w_) {}
+        void operator()() const { pool->work(w); }
+    };
+
+    void run_job(const job& j, sz size, bool nesting);
+    void work(sz w);
+    // own is the index of the caller's deque, or deques.size() if it has none; waiting is the batch it waits for, if any
+    bool take(sz own, const batch* waiting, task& t);
+    void execute(const task& t);
+
+    boost::ptr_vector<worker_deque> deques; // one per worker
+    boost::atomic<sz> queued; // tasks in the deques, or about to be; never less
+    boost::mutex idle_m;
+    boost::condition idle; // waited on by the workers that found nothing to take
+    boost::atomic<sz> events; // tasks queued or a batch finished; modified under idle_m
+    boost::condition progress; // waited on by the callers of run that found nothing to take, notified with events
+    bool stopping; // dtor called
+    boost::thread_specific_ptr<sz> own_deque; // of the worker threads
+    boost::thread_group workers;
+};
+
+#endif
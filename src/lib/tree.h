@@ -68,11 +68,11 @@ struct atom_range {
 
 struct atom_frame : public frame, public atom_range {
     atom_frame(const vec& origin_, sz begin_, sz end_) : frame(origin_), atom_range(begin_, end_) {}
-    void set_coords(const atomv& atoms, vecv& coords) const {
+    void set_coords(const atomv& atoms, soa_vecv& coords) const {
         VINA_RANGE(i, begin, end)
-        coords[i] = local_to_lab(atoms[i].coords);
+        coords.set(i, local_to_lab(atoms[i].coords));
     }
-    vecp sum_force_and_torque(const vecv& coords, const vecv& forces) const {
+    vecp sum_force_and_torque(const soa_vecv& coords, const soa_vecv& forces) const {
         vecp tmp;
         tmp.first.assign(0);
         tmp.second.assign(0);
@@ -86,7 +86,7 @@ struct atom_frame : public frame, public atom_range {
 
 struct rigid_body : public atom_frame {
     rigid_body(const vec& origin_, sz begin_, sz end_) : atom_frame(origin_, begin_, end_) {}
-    void set_conf(const atomv& atoms, vecv& coords, const rigid_conf& c) {
+    void set_conf(const atomv& atoms, soa_vecv& coords, const rigid_conf& c) {
         origin = c.position;
         set_orientation(c.orientation);
         set_coords(atoms, coords);
@@ -119,9 +119,7 @@ struct segment : public axis_frame {
         relative_axis = axis;
         relative_origin = origin - parent.get_origin();
     }
-    void set_conf(const frame& parent, const atomv& atoms, vecv& coords, flv::const_iterator& c) {
-        const fl torsion = *c;
-        ++c;
+    void set_conf(const frame& parent, const atomv& atoms, soa_vecv& coords, fl torsion) {
         origin = parent.local_to_lab(relative_origin);
         axis = parent.local_to_lab_direction(relative_axis);
         qt tmp = angle_to_quaternion(axis, torsion) * parent.orientation();
@@ -130,9 +128,6 @@ struct segment : public axis_frame {
         set_orientation(tmp);
         set_coords(atoms, coords);
     }
-    void count_torsions(sz& s) const {
-        ++s;
-    }
 private:
     vec relative_axis;
     vec relative_origin;
@@ -141,7 +136,7 @@ private:
 struct first_segment : public axis_frame {
     first_segment(const segment& s) : axis_frame(s) {}
     first_segment(const vec& origin_, sz begin_, sz end_, const vec& axis_root) : axis_frame(origin_, begin_, end_, axis_root) {}
-    void set_conf(const atomv& atoms, vecv& coords, fl torsion) {
+    void set_conf(const atomv& atoms, soa_vecv& coords, fl torsion) {
         set_orientation(angle_to_quaternion(axis, torsion));
         set_coords(atoms, coords);
     }
@@ -150,86 +145,93 @@ struct first_segment : public axis_frame {
     }
 };
 
-template<typename T> // T == branch
-void branches_set_conf(std::vector<T>& b, const frame& parent, const atomv& atoms, vecv& coords, flv::const_iterator& c) {
-    VINA_FOR_IN(i, b)
-    b[i].set_conf(parent, atoms, coords, c);
-}
-
-template<typename T> // T == branch
-void branches_derivative(const std::vector<T>& b, const vec& origin, const vecv& coords, const vecv& forces, vecp& out, flv::iterator& d) { // adds to out
-    VINA_FOR_IN(i, b) {
-        vecp force_torque = b[i].derivative(coords, forces, d);
-        out.first  += force_torque.first;
-        vec r;
-        r = b[i].node.get_origin() - origin;
-        out.second += cross_product(r, force_torque.first) + force_torque.second;
-    }
-}
-
-template<typename T> // T == segment
-struct tree {
-    T node;
-    std::vector< tree<T> > children;
-    tree(const T& node_) : node(node_) {}
-    void set_conf(const frame& parent, const atomv& atoms, vecv& coords, flv::const_iterator& c) {
-        node.set_conf(parent, atoms, coords, c);
-        branches_set_conf(children, node, atoms, coords, c);
-    }
-    vecp derivative(const vecv& coords, const vecv& forces, flv::iterator& p) const {
-        vecp force_torque = node.sum_force_and_torque(coords, forces);
-        fl& d = *p; // reference
-        ++p;
-        branches_derivative(children, node.get_origin(), coords, forces, force_torque, p);
-        node.set_derivative(force_torque, d);
-        return force_torque;
-    }
-};
-
-typedef tree<segment> branch;
-typedef std::vector<branch> branches;
+const sz heterotree_node = max_sz; // as the parent of a segment: the node of its heterotree
 
+// The segments are stored flat, depth first, which is also the order of their
+// torsions: set_conf is one forward sweep and derivative one backward sweep.
 template<typename Node> // Node == first_segment || rigid_body
 struct heterotree {
     Node node;
-    branches children;
+    std::vector<segment> segments;
+    szv parents; // of each segment, its index in segments or heterotree_node
+    szv subtree_ends; // of each segment, one past its last descendant, which is also where its next sibling is
     heterotree(const Node& node_) : node(node_) {}
-    void set_conf(const atomv& atoms, vecv& coords, const ligand_conf& c) {
+    atom_frame& frame_of(sz i) { // i == heterotree_node or a segment index
+        if(i == heterotree_node) return node;
+        return segments[i];
+    }
+    const atom_frame& frame_of(sz i) const {
+        if(i == heterotree_node) return node;
+        return segments[i];
+    }
+    sz add_segment(const segment& s, sz parent) { // its descendants are added next, followed by end_segment
+        segments.push_back(s);
+        parents.push_back(parent);
+        subtree_ends.push_back(0);
+        return segments.size() - 1;
+    }
+    void end_segment(sz i) {
+        subtree_ends[i] = segments.size();
+    }
+    sz children_begin(sz i) const {
+        return (i == heterotree_node) ? 0 : i + 1;
+    }
+    sz children_end(sz i) const {
+        return (i == heterotree_node) ? segments.size() : subtree_ends[i];
+    }
+    void set_conf(const atomv& atoms, soa_vecv& coords, const ligand_conf& c) {
         node.set_conf(atoms, coords, c.rigid);
-        flv::const_iterator p = c.torsions.begin();
-        branches_set_conf(children, node, atoms, coords, p);
-        assert(p == c.torsions.end());
-    }
-    void set_conf(const atomv& atoms, vecv& coords, const residue_conf& c) {
-        flv::const_iterator p = c.torsions.begin();
-        node.set_conf(atoms, coords, *p);
-        ++p;
-        branches_set_conf(children, node, atoms, coords, p);
-        assert(p == c.torsions.end());
-    }
-    void derivative(const vecv& coords, const vecv& forces, ligand_change& c) const {
+        segments_set_conf(atoms, coords, c.torsions, 0);
+    }
+    void set_conf(const atomv& atoms, soa_vecv& coords, const residue_conf& c) {
+        node.set_conf(atoms, coords, c.torsions[0]);
+        segments_set_conf(atoms, coords, c.torsions, 1);
+    }
+    void derivative(const soa_vecv& coords, const soa_vecv& forces, ligand_change& c) const {
         vecp force_torque = node.sum_force_and_torque(coords, forces);
-        flv::iterator p = c.torsions.begin();
-        branches_derivative(children, node.get_origin(), coords, forces, force_torque, p);
+        segments_derivative(coords, forces, c.torsions, 0, force_torque);
         node.set_derivative(force_torque, c.rigid);
-        assert(p == c.torsions.end());
     }
-    void derivative(const vecv& coords, const vecv& forces, residue_change& c) const {
+    void derivative(const soa_vecv& coords, const soa_vecv& forces, residue_change& c) const {
         vecp force_torque = node.sum_force_and_torque(coords, forces);
-        flv::iterator p = c.torsions.begin();
-        fl& d = *p; // reference
-        ++p;
-        branches_derivative(children, node.get_origin(), coords, forces, force_torque, p);
-        node.set_derivative(force_torque, d);
-        assert(p == c.torsions.end());
+        segments_derivative(coords, forces, c.torsions, 1, force_torque);
+        node.set_derivative(force_torque, c.torsions[0]);
+    }
+private:
+    mutable std::vector<vecp> force_torques; // of each segment, scratch for derivative
+    void segments_set_conf(const atomv& atoms, soa_vecv& coords, const flv& torsions, sz first_torsion) {
+        assert(torsions.size() == first_torsion + segments.size());
+        VINA_FOR_IN(i, segments)
+        segments[i].set_conf(frame_of(parents[i]), atoms, coords, torsions[first_torsion + i]); // parents come first
+    }
+    void segments_derivative(const soa_vecv& coords, const soa_vecv& forces, flv& torsions, sz first_torsion, vecp& force_torque) const { // adds to force_torque, that of node
+        assert(torsions.size() == first_torsion + segments.size());
+        force_torques.resize(segments.size());
+        sz i = segments.size();
+        while(i > 0) { // children come first
+            --i;
+            force_torques[i] = segments[i].sum_force_and_torque(coords, forces);
+            add_children(i, force_torques[i]);
+            segments[i].set_derivative(force_torques[i], torsions[first_torsion + i]);
+        }
+        add_children(heterotree_node, force_torque);
+    }
+    void add_children(sz i, vecp& out) const { // in order
+        const vec& origin = frame_of(i).get_origin();
+        for(sz j = children_begin(i); j < children_end(i); j = subtree_ends[j]) {
+            const vecp& force_torque = force_torques[j];
+            out.first  += force_torque.first;
+            vec r;
+            r = segments[j].get_origin() - origin;
+            out.second += cross_product(r, force_torque.first) + force_torque.second;
+        }
     }
 };
 
-template<typename T> // T = main_branch, branch, flexible_body
-void count_torsions(const T& t, sz& s) {
+template<typename Node>
+void count_torsions(const heterotree<Node>& t, sz& s) {
     t.node.count_torsions(s);
-    VINA_FOR_IN(i, t.children)
-    count_torsions(t.children[i], s);
+    s += t.segments.size();
 }
 
 typedef heterotree<rigid_body> flexible_body;
@@ -238,7 +240,7 @@ typedef heterotree<first_segment> main_branch;
 template<typename T> // T == flexible_body || main_branch
 struct vector_mutable : public std::vector<T> {
     template<typename C>
-    void set_conf(const atomv& atoms, vecv& coords, const std::vector<C>& c) { // C == ligand_conf || residue_conf
+    void set_conf(const atomv& atoms, soa_vecv& coords, const std::vector<C>& c) { // C == ligand_conf || residue_conf
         VINA_FOR_IN(i, (*this))
         (*this)[i].set_conf(atoms, coords, c[i]);
     }
@@ -249,17 +251,17 @@ struct vector_mutable : public std::vector<T> {
         return tmp;
     }
     template<typename C>
-    void derivative(const vecv& coords, const vecv& forces, std::vector<C>& c) const { // C == ligand_change || residue_change
+    void derivative(const soa_vecv& coords, const soa_vecv& forces, std::vector<C>& c) const { // C == ligand_change || residue_change
         VINA_FOR_IN(i, (*this))
         (*this)[i].derivative(coords, forces, c[i]);
     }
 };
 
-template<typename T, typename F> // tree or heterotree - like structure
+template<typename T, typename F> // T == heterotree
 void transform_ranges(T& t, const F& f) {
     t.node.transform(f);
-    VINA_FOR_IN(i, t.children)
-    transform_ranges(t.children[i], f);
+    VINA_FOR_IN(i, t.segments)
+    t.segments[i].transform(f);
 }
 
 #endif
@@ -1,50 +1,108 @@
 #include "visited.h"
 
-double ele::dist2(std::vector<double> now) {
-    double out=0;
-    for (int i=0; i<size(); i++) {
-        double d = this->x[i] - now[i];
-        out += d * d;
+void visited::allocate() {
+    capacity=10*n_variable;
+    stride=(capacity+3)/4*4;
+    xs.assign(n_variable*stride, 0);
+    fs.assign(capacity, 0);
+    d_zero.assign(capacity, 0);
+    d_positive.assign(capacity, 0);
+    dist.assign(stride, 0);
+    nearest.reserve(capacity);
+}
+
+bool visited::add(const conf& conf_v, double f, const change& change_v) {
+    tempx.clear(); // keeps the capacity
+    tempd.clear();
+    conf_v.getV(tempx);
+    change_v.getV(tempd);
+
+    if (len==0)
+    {
+        n_variable=tempx.size();
+        n_derivative=tempd.size();
+        allocate();
+    }
+    else
+    {
+        if (tempx.size()!=n_variable)
+        {
+            printf("local search designing variables not the same");
+            return false;
+        }
+    }
+
+    const int entry=full ? p : len; // appended until full, then the oldest one is replaced
+    for (int i=0; i<n_variable; i++)
+        xs[i*stride+entry]=tempx[i];
+    fs[entry]=f;
+    long long zero=0;
+    long long positive=0;
+    const long long ONE=1;
+    for (int i=0; i<tempd.size(); i++) {
+        const long long bitMask=ONE<<i;
+        if (tempd[i]==0) zero |= bitMask;
+        else if (tempd[i]>0) positive |= bitMask;
+    }
+    d_zero[entry]=zero;
+    d_positive[entry]=positive;
+
+    if (!full)
+    {
+        len++;
+        if (len>=capacity)
+        {
+            full=true;
+            p=0;
+        }
+    }
+    else
+    {
+        p=(p+1)%capacity;
+    }
+    return true;
+}
+
+// dist[e] = the squared distance from now_x to entry e, for all the entries: the squares of the
+// differences are rounded, then added in the order of the variables, on every machine. The loop
+// over the entries is the inner one, so that the compiler vectorizes it; the build does not
+// contract the multiplications and additions into fma (-ffp-contract=off in makefile_common).
+void visited::distances(const std::vector<double>& now_x) {
+    dist.assign(len, 0); // keeps the capacity
+    for (int i=0; i<n_variable; i++) {
+        const double* x=&xs[i*stride];
+        const double c=now_x[i];
+        for (int e=0; e<len; e++) {
+            const double d=x[e]-c;
+            dist[e]+=d*d;
+        }
     }
-    return out;
 }
-//static bool comp(std::pair<int, double> p, std::pair<int, double> q)
-//{
-//	return (p.second<q.second);
-//}
 
 /** differences:
  * 1- I check also the value of f
  * 2- point is considered interesting if only half of number of variables contains stationary points
 */
-bool ele::check(std::vector<double> now_x, double now_f, std::vector<double> now_d)
+bool visited::check(int entry, const std::vector<double>& now_x, double now_f, const std::vector<double>& now_d) const
 {
-    bool out=false;
-
-//	int counter=0;//no need currently
     bool newXBigger, newYBigger;
     const long long ONE=1;
     long long bitMask =0;
-    newYBigger=(now_f -f) > 0;
-//	bool effect=false;
+    newYBigger=(now_f -fs[entry]) > 0;
 
     int nowDSize = now_d.size();
     for (int i = 0; i < nowDSize; i++) {
         bitMask = ONE << i;
 
-        if((d_zero & bitMask) || !(now_d[i])) { //if any of them is zero
-//			counter++;//no need currently
+        if((d_zero[entry] & bitMask) || !(now_d[i])) { //if any of them is zero
         } else {
             const bool nowPositive= now_d[i] > 0;
-            const bool dPositive= d_positive & bitMask;
+            const bool dPositive= d_positive[entry] & bitMask;
             if (nowPositive ^ dPositive) {//if both derivatives have different signs
-//				counter++;//no need currently
             }
             else {
-                newXBigger=(now_x[i]-x[i]) > 0;
+                newXBigger=(now_x[i]-xs[i*stride+entry]) > 0;
                 if (nowPositive? (newXBigger ^ newYBigger): (!(newXBigger ^ newYBigger))) {//if the higher x have lower f (if both ascending), or vice versa
-//					counter++;//no need currently
-//					effect=true;
                 }
                 //TODO this else is valid only in case the least accepted number is
                 //ALLLLLL the variables (to be removed if we want to relax the check later on)
@@ -53,68 +111,57 @@ bool ele::check(std::vector<double> now_x, double now_f, std::vector<double> now
                 }
             }
         }
-//		if (counter >= (now_d.size())) {
-//			return true;
-//		}
     }
     return true; //just return true, no need for check (to be removed if we want to relax the check later on)
-
-//	out=((((d_positive^now_positive)|d_zero)|now_zero)==getMask());
-////	printf("mask=%ld\td_p=%ld\td_z=%ld\tn_p=%ld\tn_z=%ld\n",getMask(),d_positive,d_zero,now_positive,now_zero);
-////	printf("check=%s\n",temp?"true":"false");
-////	getchar();
-////	}
-////	return out;
-
-//	return false;
 }
 
-bool visited::interesting(conf x, double f, change g) {
-    int len=size();
-    if (len==0) {
+struct closer_entry { // by distance, then by position, the order in which the entries used to be picked
+    const std::vector<double>& dist;
+    closer_entry(const std::vector<double>& dist_) : dist(dist_) {}
+    bool operator()(int a, int b) const {
+        return dist[a] < dist[b] || (dist[a] == dist[b] && a < b);
+    }
+};
+
+bool visited::interesting(const conf& x, double f, const change& g) {
+    if (!full) {
         return true;
     }
-    else
-    {
-//			if (len<2*n_variable)
-        if (!full) {
-//				printf("len==%d<%d\n",len,10*n_variable);
-            return true;
-        }
-        else
-        {
-            std::vector<double> conf_v;
-            x.getV(conf_v);
-            std::vector<double> change_v;
-            g.getV(change_v);
-            double dist[len];
-            bool notPicked[len];
+    std::vector<double>& conf_v = tempx; // reused, as in add
+    conf_v.clear();
+    x.getV(conf_v);
+    std::vector<double>& change_v = tempd;
+    change_v.clear();
+    g.getV(change_v);
+    distances(conf_v);
 
-            memset(notPicked,true,sizeof(notPicked));
-            //fill dist[] with distances from conf
-            for (int i=0; i<len; i++) {
-                dist[i]=this->get(i).dist2(conf_v);
-            }
+    // up to maxCheck of the nearest entries are checked; the ones at 1e10 or farther, or at nan,
+    // were never picked
+    nearest.clear();
+    for (int e=0; e<len; e++)
+        if (dist[e]<1e10)
+            nearest.push_back(e);
+    const int maxCheck = 2 * n_variable;
+    if (nearest.empty())
+        return check(0, conf_v, f, change_v); // the entry picked when none was closer than 1e10
+    const int k=(std::min)(maxCheck, int(nearest.size()));
+    std::partial_sort(nearest.begin(), nearest.begin()+k, nearest.end(), closer_entry(dist));
+    for (int i = 0; i < k; i++)
+        if (check(nearest[i], conf_v, f, change_v))
+            return true;
+    return false; // the remaining picks repeated the last entry
+}
 
-            bool flag=false;
-            double min=1e10;
-            int p=0;
-            const int maxCheck = 2 * n_variable;
-            for (int i = 0; i < maxCheck; i++) {
-                min=1e10;
-                for (int j=0; j<len; j++) {
-                    if (notPicked[j] && (dist[j]<min)) {
-                        p=j;
-                        min=dist[j];
-                    }
-                }
-                notPicked[p]=false;
-                flag=this->get(p).check(conf_v, f, change_v);
-                if (flag) break;
-            }
-            return flag;
-        }
+void visited::print() const
+{
+    for (int e=0; e<size(); e++)
+    {
+        std::vector<double> x(n_variable);
+        for (int i=0; i<n_variable; i++)
+            x[i]=xs[i*stride+e];
+        ::print(x);
+        printf(" %f\n",fs[e]);
+        printf("d_zero=%lld\td_positive=%lld\n",d_zero[e],d_positive[e]);
+        printf("\n");
     }
-    return true;
 }
-
@@ -32,6 +32,7 @@
 #include <boost/filesystem/fstream.hpp>
 #include <boost/filesystem/exception.hpp>
 #include <boost/filesystem/convenience.hpp> // filesystem::basename
+#include <boost/filesystem/operations.hpp> // exists
 #include <boost/thread/thread.hpp> // hardware_concurrency // FIXME rm ?
 
 #include <boost/date_time/posix_time/posix_time.hpp> // for time in microseconds
@@ -48,6 +49,7 @@
 #include "quasi_newton.h"
 #include "tee.h"
 #include "coords.h" // add_to_output_container
+#include "thread_pool.h"
 //#include <ctime>
 
 #include <queue>          // std::queue
@@ -133,10 +135,11 @@ void do_randomization(model& m,
     m.write_structure(make_path(out_name));
 }
 
-void refine_structure(model& m, const precalculate& prec, non_cache& nc, output_type& out, const vec& cap, sz max_steps = 1000) {
+void refine_structure(model& m, const precalculate& prec, non_cache& nc, output_type& out, const vec& cap, sz max_steps = 1000, sz lbfgs_history = 0) {
     change g(m.get_size());//initialized to be all zeros, and fit to the size of the model
     quasi_newton quasi_newton_par;
     quasi_newton_par.max_steps = max_steps;
+    quasi_newton_par.lbfgs_history = lbfgs_history;
     const fl slope_orig = nc.slope;
     VINA_FOR(p, 5) {
         nc.slope = 100 * std::pow(10.0, 2.0*p);
@@ -151,6 +154,25 @@ void refine_structure(model& m, const precalculate& prec, non_cache& nc, output_
     nc.slope = slope_orig;
 }
 
+// refines out[i] on its own copies of the model, whose visited history the local search adds to, and of nc, whose slope
+// refine_structure changes; so the result of each mode does not depend on the others, or on the order
+struct refine_aux {
+    const model& m;
+    const precalculate& prec;
+    const non_cache& nc;
+    output_container& out;
+    const vec& cap;
+    sz max_steps;
+    sz lbfgs_history;
+    refine_aux(const model& m_, const precalculate& prec_, const non_cache& nc_, output_container& out_, const vec& cap_, sz max_steps_, sz lbfgs_history_)
+        : m(m_), prec(prec_), nc(nc_), out(out_), cap(cap_), max_steps(max_steps_), lbfgs_history(lbfgs_history_) {}
+    void operator()(sz i) const {
+        model m_copy(m);
+        non_cache nc_copy(nc);
+        refine_structure(m_copy, prec, nc_copy, out[i], cap, max_steps, lbfgs_history);
+    }
+};
+
 std::string vina_remark(fl e, fl lb, fl ub) {
     std::ostringstream remark;
     remark.setf(std::ios::fixed, std::ios::floatfield);
@@ -208,7 +230,7 @@ void do_search(model& m, const boost::optional<model>& ref, const scoring_functi
     else if(local_only) {
         output_type out(c, e);
         doing(verbosity, "Performing local search", log);
-        refine_structure(m, prec, nc, out, authentic_v, par.mc.ssd_par.evals);
+        refine_structure(m, prec, nc, out, authentic_v, par.mc.ssd_par.evals, par.mc.lbfgs_history);
         done(verbosity, log);
         fl intramolecular_energy = m.eval_intramolecular(prec, authentic_v, out.c);
         e = m.eval_adjusted(sf, prec, nc, authentic_v, out.c, intramolecular_energy);
@@ -236,18 +258,24 @@ void do_search(model& m, const boost::optional<model>& ref, const scoring_functi
         ptime time_start(microsec_clock::local_time());
 //		time(&start);
 
-        par(m, out_cont, prec, ig, prec_widened, ig_widened, corner1, corner2, generator);
+        const sz steps_taken = par(m, out_cont, prec, ig, prec_widened, ig_widened, corner1, corner2, generator);
         done(verbosity, log);
+        if(par.mc.stagnation_steps > 0) {
+            const sz steps_allowed = par.num_tasks * par.mc.num_steps;
+            log << "Monte Carlo steps taken: " << steps_taken << " of " << steps_allowed << " ("
+                << std::fixed << std::setprecision(1) << (100.0 * (steps_allowed - steps_taken) / steps_allowed) << "% saved by stagnation_steps)";
+            log.endl();
+        }
 
         doing(verbosity, "Refining results", log);
-        VINA_FOR_IN(i, out_cont)
-        refine_structure(m, prec, nc, out_cont[i], authentic_v, par.mc.ssd_par.evals);
+        refine_aux refine(m, prec, nc, out_cont, authentic_v, par.mc.ssd_par.evals, par.mc.lbfgs_history);
+        thread_pool::process_wide(par.num_threads).run(refine, out_cont.size());
 
         ptime time_end(microsec_clock::local_time());
         time_duration duration(time_end - time_start);
 //		time(&end);
 //		printf("\nsearching finished in %.3lf seconds\n",difftime(end,start));
-        printf("\nsearching finished in %.3lf seconds\n",(duration.total_milliseconds()/1000.0));
+        log << "\nsearching finished in " << std::fixed << std::setprecision(3) << (duration.total_milliseconds()/1000.0) << " seconds\n";
 
         if(!out_cont.empty()) {
             out_cont.sort();
@@ -304,11 +332,100 @@ void do_search(model& m, const boost::optional<model>& ref, const scoring_functi
     }
 }
 
+const fl grid_slope = 1e6; // FIXME: too large? used to be 100
+
+const sz lbfgs_min_degrees_of_freedom = 30; // from which local_optimizer auto uses lbfgs, see vina_benchmark --optimizer_benchmark
+
+// The options of the grids, the pair tables and the Monte Carlo search, for main_procedure and batch_session
+struct search_settings {
+    boost::optional<std::string> grid_cache_dir; // see populate_cache
+    bool single_precision_grids;
+    bool interleaved_grids;
+    bool lazy_grids;
+    fl compact_table_factor; // see precalculate::compact; 0 for the full tables only
+    std::string local_optimizer; // see local_optimizer_history
+    sz lbfgs_history;
+    sz chain_split; // see make_parallel_mc
+    sz stagnation_steps;
+    sz replicas;
+    fl max_temperature;
+    sz exchange_steps;
+    search_settings() : single_precision_grids(false), interleaved_grids(false), lazy_grids(false), compact_table_factor(0), local_optimizer("bfgs"), lbfgs_history(0),
+                        chain_split(1), stagnation_steps(0), replicas(1), max_temperature(0), exchange_steps(0) {}
+};
+
+// the lbfgs history for the local optimization of m with local_optimizer (bfgs, lbfgs or auto), 0 for bfgs
+sz local_optimizer_history(const model& m, const std::string& local_optimizer, sz lbfgs_history) {
+    if(local_optimizer == "lbfgs" || (local_optimizer == "auto" && m.get_size().num_degrees_of_freedom() >= lbfgs_min_degrees_of_freedom))
+        return lbfgs_history;
+    return 0;
+}
+
+// each of the exhaustiveness chains is run as chain_split chains of as many steps in total, see --chain_split;
+// with stagnation_steps, the chains may stop early, see monte_carlo::stagnation_steps; with replicas, they are
+// replica exchange ladders, see parallel_mc::replicas
+parallel_mc make_parallel_mc(const model& m, int exhaustiveness, const search_settings& settings, int cpu, int verbosity) {
+    const sz chain_split = settings.chain_split;
+    parallel_mc par;
+    sz heuristic = m.num_movable_atoms() + 10 * m.get_size().num_degrees_of_freedom();
+    const sz num_steps = 70 * 3 * (50 + heuristic) / 2; // 2 * 70 -> 8 * 20 // FIXME
+    par.mc.num_steps = unsigned((num_steps + chain_split - 1) / chain_split);
+    par.mc.ssd_par.evals = unsigned((25 + m.num_movable_atoms()) / 3);
+    par.mc.lbfgs_history = local_optimizer_history(m, settings.local_optimizer, settings.lbfgs_history);
+    par.mc.min_rmsd = 1.0;
+    par.mc.num_saved_mins = 20;
+    par.mc.hunt_cap = vec(10, 10, 10);
+    par.mc.stagnation_steps = unsigned(settings.stagnation_steps);
+    par.num_tasks = exhaustiveness * chain_split;
+    par.num_threads = cpu;
+    par.display_progress = (verbosity > 1);
+    par.replicas = settings.replicas;
+    par.max_temperature = settings.max_temperature;
+    par.exchange_steps = unsigned(settings.exchange_steps);
+    return par;
+}
+
+// Populates the grids of c for the given types. With a grid cache directory,
+// grids stored there for the same receptor, box and weights are mapped instead
+// of computed, and the file is rewritten if anything had to be computed.
+void populate_cache(cache& c, const model& m, const precalculate& prec, const szv& atom_types_needed, const flv& weights,
+                    const boost::optional<std::string>& grid_cache_dir, int cpu, tee& log) {
+    path name;
+    if(grid_cache_dir) {
+        name = make_path(grid_cache_dir.get()) / c.file_name(m, weights);
+        if(boost::filesystem::exists(name)) {
+            try {
+                c.read(name, m, weights);
+            }
+            catch(cache_mismatch&) {
+                log << "WARNING: ignoring grid cache file " << name.string() << ", it was made for different inputs";
+                log.endl();
+            }
+            catch(file_error&) { // e.g. empty or unreadable
+                log << "WARNING: ignoring grid cache file " << name.string() << ", it could not be read";
+                log.endl();
+            }
+        }
+    }
+    if(c.populated(atom_types_needed))
+        return;
+    c.populate(m, prec, atom_types_needed, true, cpu);
+    if(grid_cache_dir && !c.is_lazy()) { // lazy grids have nothing to write yet
+        try {
+            c.write(name, m, weights);
+        }
+        catch(file_error& e) {
+            log << "WARNING: could not write grid cache file " << e.name.string();
+            log.endl();
+        }
+    }
+}
+
 void main_procedure(model& m, const boost::optional<model>& ref, // m is non-const (FIXME?)
                     const std::string& out_name,
                     bool score_only, bool local_only, bool randomize_only, bool no_cache,
                     const grid_dims& gd, int exhaustiveness,
-                    const flv& weights,
+                    const flv& weights, const search_settings& settings,
                     int cpu, int seed, int verbosity, sz num_modes, fl energy_range, tee& log) {
 
     doing(verbosity, "Setting up the scoring function", log);
@@ -325,28 +442,24 @@ void main_procedure(model& m, const boost::optional<model>& ref, // m is non-con
 
     done(verbosity, log);
 
+    if(settings.compact_table_factor > 0) {
+        const szv pairs = m.get_type_pairs(prec);
+        prec.compact(pairs, settings.compact_table_factor);
+        prec_widened.compact(pairs, settings.compact_table_factor);
+    }
+
     vec corner1(gd[0].begin, gd[1].begin, gd[2].begin);
     vec corner2(gd[0].end,   gd[1].end,   gd[2].end);
 
-    parallel_mc par;
-    sz heuristic = m.num_movable_atoms() + 10 * m.get_size().num_degrees_of_freedom();
-    par.mc.num_steps = unsigned(70 * 3 * (50 + heuristic) / 2); // 2 * 70 -> 8 * 20 // FIXME
-    par.mc.ssd_par.evals = unsigned((25 + m.num_movable_atoms()) / 3);
-    par.mc.min_rmsd = 1.0;
-    par.mc.num_saved_mins = 20;
-    par.mc.hunt_cap = vec(10, 10, 10);
-    par.num_tasks = exhaustiveness;
-    par.num_threads = cpu;
-    par.display_progress = (verbosity > 1);
+    parallel_mc par = make_parallel_mc(m, exhaustiveness, settings, cpu, verbosity);
 
-    const fl slope = 1e6; // FIXME: too large? used to be 100
     if(randomize_only) {
         do_randomization(m, out_name,
                          corner1, corner2, seed, verbosity, log);
     }
     else {
-        non_cache nc        (m, gd, &prec,         slope); // if gd has 0 n's, this will not constrain anything
-        non_cache nc_widened(m, gd, &prec_widened, slope); // if gd has 0 n's, this will not constrain anything
+        non_cache nc        (m, gd, &prec,         grid_slope); // if gd has 0 n's, this will not constrain anything
+        non_cache nc_widened(m, gd, &prec_widened, grid_slope); // if gd has 0 n's, this will not constrain anything
         if(no_cache) {
             do_search(m, ref, wt, prec, nc, prec_widened, nc_widened, nc,
                       out_name,
@@ -357,17 +470,232 @@ void main_procedure(model& m, const boost::optional<model>& ref, // m is non-con
         else {
             bool cache_needed = !(score_only || randomize_only || local_only);
             if(cache_needed) doing(verbosity, "Analyzing the binding site", log);
-            cache c("scoring_function_version001", gd, slope, atom_type::XS);
-            if(cache_needed) c.populate(m, prec, m.get_movable_atom_types(prec.atom_typing_used()));
+            cache c("scoring_function_version001", gd, grid_slope, atom_type::XS, settings.single_precision_grids, settings.lazy_grids);
+            if(cache_needed) populate_cache(c, m, prec, m.get_movable_atom_types(prec.atom_typing_used()), weights, settings.grid_cache_dir, cpu, log);
             if(cache_needed) done(verbosity, log);
+            if(cache_needed && settings.interleaved_grids)
+                c.interleave();
             do_search(m, ref, wt, prec, c, prec, c, nc,
                       out_name,
                       corner1, corner2,
                       par, energy_range, num_modes,
                       seed, verbosity, score_only, local_only, log, t, weights);
+            if(cache_needed && settings.lazy_grids) {
+                log << "Lazy grids: " << std::setprecision(1) << 100 * c.lazy_fraction() << "% of the bricks were computed";
+                log.endl();
+            }
+        }
+    }
+}
+
+szv all_atom_types(atom_type::t atom_typing_used) {
+    szv tmp;
+    VINA_FOR(i, num_atom_types(atom_typing_used))
+    tmp.push_back(i);
+    return tmp;
+}
+
+// Receptor-side state of a batch run. Everything main_procedure builds for the
+// cached search except the ligand itself depends only on the receptor and the
+// box, so it is built once here and the grids are populated for every XS type;
+// lazy grids are instead added for the types of each ligand as it comes, so
+// that their bricks compute only the types some ligand has.
+// Docking a ligand then only reads it, apart from the slope of nc which
+// refine_structure changes and restores, and the compact tables of prec which
+// are remade for the type pairs of each ligand.
+struct batch_session {
+    batch_session(const model& receptor, const grid_dims& gd_, const flv& weights_, bool cache_needed, const search_settings& settings_, int cpu, tee& log)
+        : gd(gd_), weights(weights_), wt(&t, weights_), prec(wt), settings(settings_), lazy_types(cache_needed && settings_.lazy_grids), concurrent(false),
+          nc(receptor, gd_, &prec, grid_slope), // receptor has no movable atoms yet, but non_cache only looks at grid_atoms
+          c("scoring_function_version001", gd_, grid_slope, atom_type::XS, settings_.single_precision_grids, settings_.lazy_grids) {
+        VINA_CHECK(weights.size() == 6);
+        if(cache_needed && !lazy_types)
+            populate_cache(c, receptor, prec, all_atom_types(prec.atom_typing_used()), weights, settings.grid_cache_dir, cpu, log);
+        if(cache_needed && settings.interleaved_grids)
+            c.interleave();
+    }
+    void use_concurrent_docking() { // dock may then be called from several threads at once, see concurrent_batch
+        concurrent = true;
+    }
+    sz share_grids() { // with the processes forked afterwards, see cache::share
+        return c.share();
+    }
+    sz share_size() const {
+        return c.share_size();
+    }
+    void share_grids(char* destination, std::vector<boost::uint64_t>& offsets) {
+        c.share(destination, offsets);
+    }
+    void attach_grids(const char* source, const std::vector<boost::uint64_t>& offsets, bool interleaved_grids) { // instead of populating
+        c.attach(source, offsets, interleaved_grids);
+    }
+    void dock(model& m, const std::string& out_name,
+              bool score_only, bool local_only, bool randomize_only,
+              int exhaustiveness, int cpu, int seed, int verbosity, sz num_modes, fl energy_range, tee& log) {
+        vec corner1(gd[0].begin, gd[1].begin, gd[2].begin);
+        vec corner2(gd[0].end,   gd[1].end,   gd[2].end);
+
+        if(lazy_types) {
+            boost::mutex::scoped_lock lk(populating); // the grids of the other types are in use by concurrent docking
+            populate_cache(c, m, prec, m.get_movable_atom_types(prec.atom_typing_used()), weights, settings.grid_cache_dir, cpu, log);
+            if(settings.interleaved_grids)
+                c.interleave();
+        }
+
+        parallel_mc par = make_parallel_mc(m, exhaustiveness, settings, cpu, verbosity);
+        boost::optional<precalculate> ligand_prec; // with concurrent docking, for the compact tables of m
+        boost::optional<non_cache> ligand_nc; // likewise, for the slope that refine_structure changes
+        if(concurrent) {
+            par.display_progress = false; // the progress bars of the ligands would mix
+            if(settings.compact_table_factor > 0)
+                ligand_prec = prec;
+        }
+        precalculate& p = ligand_prec ? ligand_prec.get() : prec;
+        if(concurrent)
+            ligand_nc = non_cache(nc, &p);
+        non_cache& n = ligand_nc ? ligand_nc.get() : nc;
+        if(settings.compact_table_factor > 0)
+            p.compact(m.get_type_pairs(p), settings.compact_table_factor);
+
+        if(randomize_only)
+            do_randomization(m, out_name,
+                             corner1, corner2, seed, verbosity, log);
+        else {
+            boost::optional<model> ref;
+            do_search(m, ref, wt, p, c, p, c, n,
+                      out_name,
+                      corner1, corner2,
+                      par, energy_range, num_modes,
+                      seed, verbosity, score_only, local_only, log, t, weights);
+        }
+    }
+private:
+    grid_dims gd;
+    flv weights;
+    everything t;
+    weighted_terms wt;
+    precalculate prec;
+    search_settings settings;
+    bool lazy_types; // the grids are populated for the types of each ligand in dock
+    boost::mutex populating;
+    bool concurrent;
+    non_cache nc;
+    cache c;
+};
+
+// The in-process batch scheduler: each of ligands_in_flight tasks of the thread pool docks the next ligand
+// of the job file, until there is none left. So at most that many ligands are in memory, and their Monte
+// Carlo tasks and refinements share the threads of the pool, and the grids of the session. The seeds are
+// drawn in the order of the job file, as by the sequential loop; the output of a ligand is collected and
+// printed when it is done.
+struct concurrent_batch {
+    concurrent_batch(batch_session& session_, const model& template_model_, std::istream& jobs_, rng& generator_, const std::string& batch_out_,
+                     bool score_only_, bool local_only_, bool randomize_only_, int exhaustiveness_, int cpu_, int verbosity_, sz num_modes_, fl energy_range_, tee& log_)
+        : session(session_), template_model(template_model_), jobs(jobs_), generator(generator_), batch_out(batch_out_),
+          score_only(score_only_), local_only(local_only_), randomize_only(randomize_only_), exhaustiveness(exhaustiveness_), cpu(cpu_), verbosity(verbosity_),
+          num_modes(num_modes_), energy_range(energy_range_), log(log_), num_read(0) {}
+    void run(sz ligands_in_flight) {
+        session.use_concurrent_docking();
+        thread_pool::process_wide(cpu).run(aux(this), ligands_in_flight, true); // nesting: dock runs the tasks of each ligand
+    }
+private:
+    struct aux {
+        concurrent_batch* b;
+        aux(concurrent_batch* b_) : b(b_) {}
+        void operator()(sz) const {
+            b->dock_ligands();
+        }
+    };
+    bool next_ligand(std::string& path, int& seed, int& number) {
+        boost::mutex::scoped_lock lk(self);
+        std::getline(jobs, path);
+        if(jobs.eof() || path == "")
+            return false;
+        random_int(1, 100000000, generator); // as the sequential loop
+        seed = random_int(1, 100000000, generator);
+        number = num_read++;
+        return true;
+    }
+    void dock_ligands() {
+        std::string path;
+        int seed = 0, number = 0;
+        while(next_ligand(path, seed, number)) {
+            std::ostringstream screen;
+            tee ligand_log;
+            ligand_log.screen = &screen;
+            const std::string base_filename = path.substr(path.find_last_of("/\\") + 1);
+            ligand_log << "\nDoing ligand number " << number << " (" << base_filename << ")\n";
+            try {
+                model m(template_model);
+                m.append(parse_ligand_pdbqt(make_path(path)));
+                const std::string outname = batch_out + "/" + base_filename + ".out.pdbqt";
+                ligand_log << "output : " << outname << '\n';
+                session.dock(m, outname,
+                             score_only, local_only, randomize_only,
+                             exhaustiveness, cpu, seed, verbosity, num_modes, energy_range, ligand_log);
+            }
+            catch(...) {
+                ligand_log << "\nException caught, moving on to next ligand...\n";
+            }
+            boost::mutex::scoped_lock lk(self);
+            log << screen.str();
+            log.flush();
         }
     }
+    batch_session& session;
+    const model& template_model;
+    std::istream& jobs;
+    rng& generator;
+    std::string batch_out;
+    bool score_only;
+    bool local_only;
+    bool randomize_only;
+    int exhaustiveness;
+    int cpu;
+    int verbosity;
+    sz num_modes;
+    fl energy_range;
+    tee& log;
+    boost::mutex self; // jobs, generator, num_read and log
+    int num_read;
+};
+
+#ifdef SVINA_ENABLE_MPI
+// The first rank of node populates the grids of session into an MPI-3 shared
+// window, the other ranks of node view them there instead of populating their
+// own. Returns the window, which must be freed after the last docking.
+MPI_Win share_node_grids(batch_session& session, MPI_Comm node, bool interleaved_grids) {
+    int node_rank, node_size;
+    MPI_Comm_rank(node, &node_rank);
+    MPI_Comm_size(node, &node_size);
+    unsigned long long size = (node_rank == 0) ? session.share_size() : 0;
+    MPI_Bcast(&size, 1, MPI_UNSIGNED_LONG_LONG, 0, node);
+
+    char* base = NULL;
+    MPI_Win window;
+    MPI_Win_allocate_shared(MPI_Aint((node_rank == 0) ? size : 0), 1, MPI_INFO_NULL, node, &base, &window);
+    std::vector<boost::uint64_t> offsets;
+    if(node_rank == 0) {
+        session.share_grids(base, offsets);
+        printf("Sharing %.1f MB of grids with the %i worker ranks of this node\n", size / (1024.0 * 1024.0), node_size);
+    }
+    else {
+        MPI_Aint segment_size;
+        int disp_unit;
+        MPI_Win_shared_query(window, 0, &segment_size, &disp_unit, &base);
+    }
+    MPI_Win_fence(0, window); // the grids written by rank 0 are visible to the others from here on
+
+    unsigned long long num_offsets = offsets.size();
+    MPI_Bcast(&num_offsets, 1, MPI_UNSIGNED_LONG_LONG, 0, node);
+    offsets.resize(num_offsets);
+    if(num_offsets > 0)
+        MPI_Bcast(&offsets[0], int(num_offsets), MPI_UINT64_T, 0, node);
+    if(node_rank != 0)
+        session.attach_grids(base, offsets, interleaved_grids);
+    return window;
 }
+#endif
 
 struct usage_error : public std::runtime_error {
     usage_error(const std::string& message) : std::runtime_error(message) {}
@@ -484,10 +812,11 @@ Thank you!\n";
 ############################################################################\n\n*** This QVina has the screening additions (SVina) ***\n";
 
     try {
-        std::string rigid_name, ligand_name, flex_name, config_name, out_name, log_name, job_file, batch_out;
+        std::string rigid_name, ligand_name, flex_name, config_name, out_name, log_name, job_file, batch_out, grid_cache_dir;
         fl center_x, center_y, center_z, size_x, size_y, size_z;
         int cpu = 0, seed, exhaustiveness, verbosity = 2, num_modes = 9;
         int forknbr = 1;
+        int ligands_in_flight = 1;
         fl energy_range = 2.0;
 
         // -0.035579, -0.005156, 0.840245, -0.035069, -0.587439, 0.05846
@@ -498,6 +827,16 @@ Thank you!\n";
         fl weight_hydrogen    = -0.587439;
         fl weight_rot         =  0.05846;
         bool score_only = false, local_only = false, randomize_only = false, help = false, help_advanced = false, version = false; // FIXME
+        bool single_precision_grids = false, interleaved_grids = false, lazy_grids = false;
+        bool compact_tables = false;
+        fl compact_table_factor = 32;
+        std::string local_optimizer = "bfgs";
+        int lbfgs_history = 8;
+        int chain_split = 1;
+        int stagnation_steps = 0;
+        int replicas = 1;
+        fl replica_max_temperature = 2.4;
+        int exchange_steps = 100;
 
         bool batchMode = false;
         bool use_fork_parallelism = false;
@@ -546,6 +885,19 @@ Thank you!\n";
         ("exhaustiveness", value<int>(&exhaustiveness)->default_value(8), "exhaustiveness of the global search (roughly proportional to time): 1+")
         ("num_modes", value<int>(&num_modes)->default_value(9), "maximum number of binding modes to generate")
         ("energy_range", value<fl>(&energy_range)->default_value(3.0), "maximum energy difference between the best binding mode and the worst one displayed (kcal/mol)")
+        ("grid_cache", value<std::string>(&grid_cache_dir), "directory in which receptor grids are kept between runs, keyed by receptor, box and weights")
+        ("single_precision_grids", bool_switch(&single_precision_grids), "store receptor grids in single precision, halving their memory")
+        ("interleaved_grids", bool_switch(&interleaved_grids), "store the 8 corners of each grid voxel together, for faster lookups at 8 times the grid memory")
+        ("lazy_grids", bool_switch(&lazy_grids), "compute receptor grids in bricks of 8x8x8 points when the search first reaches them (double precision, not written to grid_cache)")
+        ("compact_tables", bool_switch(&compact_tables), "look up the intramolecular and receptor-ligand pair terms in single precision tables of the type pairs in use")
+        ("compact_table_factor", value<fl>(&compact_table_factor)->default_value(compact_table_factor), "samples per squared Angstrom in the compact tables (smaller is more compact but coarser)")
+        ("local_optimizer", value<std::string>(&local_optimizer)->default_value(local_optimizer), "bfgs, lbfgs (limited memory, for many degrees of freedom), or auto for lbfgs from 30 degrees of freedom in the ligand and flexible side chains")
+        ("lbfgs_history", value<int>(&lbfgs_history)->default_value(lbfgs_history), "number of steps lbfgs keeps")
+        ("chain_split", value<int>(&chain_split)->default_value(chain_split), "run each of the exhaustiveness Monte Carlo chains as this many shorter ones, with as many steps in total, so that more CPUs have work")
+        ("stagnation_steps", value<int>(&stagnation_steps)->default_value(stagnation_steps), "stop a Monte Carlo chain once this many steps in a row have neither improved its best energy nor changed its saved conformations (0 to always run all the steps)")
+        ("replicas", value<int>(&replicas)->default_value(replicas), "run the Monte Carlo chains as replica exchange ladders of this many, at temperatures from 1.2 to replica_max_temperature, swapping conformations between neighbouring temperatures")
+        ("replica_max_temperature", value<fl>(&replica_max_temperature)->default_value(replica_max_temperature), "temperature of the hottest chain of a replicas ladder")
+        ("exchange_steps", value<int>(&exchange_steps)->default_value(exchange_steps), "Monte Carlo steps between the exchanges of a replicas ladder")
         ;
         options_description config("Configuration file (optional)");
         config.add_options()
@@ -565,6 +917,7 @@ Thank you!\n";
         ("batchoutdir", value<std::string>(&batch_out), "batch output directory")
         ("fork-parallelism", bool_switch(&use_fork_parallelism), "use fork in addition to per-process threads")
         ("forknbr", value<int>(&forknbr), "number of fork when using fork-based parallelism")
+        ("ligands_in_flight", value<int>(&ligands_in_flight)->default_value(ligands_in_flight), "number of ligands docked at the same time by the threads of one process, sharing the grids (not with forks or MPI)")
 #ifdef SVINA_ENABLE_MPI
         ("mpi", bool_switch(&use_mpi_parallelism), "use OpenMPI-based parallelism (not compatible with forks)")
 #endif
@@ -642,6 +995,28 @@ Thank you!\n";
             throw usage_error("exhaustiveness must be 1 or greater");
         if(num_modes < 1)
             throw usage_error("num_modes must be 1 or greater");
+        if(compact_table_factor <= 0)
+            throw usage_error("compact_table_factor must be positive");
+        if(local_optimizer != "bfgs" && local_optimizer != "lbfgs" && local_optimizer != "auto")
+            throw usage_error("local_optimizer must be bfgs, lbfgs or auto");
+        if(lbfgs_history < 1)
+            throw usage_error("lbfgs_history must be 1 or greater");
+        if(chain_split < 1)
+            throw usage_error("chain_split must be 1 or greater");
+        if(stagnation_steps < 0)
+            throw usage_error("stagnation_steps must be 0 or greater");
+        if(replicas < 1)
+            throw usage_error("replicas must be 1 or greater");
+        if(replica_max_temperature <= 0)
+            throw usage_error("replica_max_temperature must be positive");
+        if(exchange_steps < 1)
+            throw usage_error("exchange_steps must be 1 or greater");
+        if(ligands_in_flight < 1)
+            throw usage_error("ligands_in_flight must be 1 or greater");
+        if(ligands_in_flight > 1 && (use_fork_parallelism || use_mpi_parallelism))
+            throw usage_error("ligands_in_flight cannot be combined with fork-parallelism or mpi");
+        if(lazy_grids && single_precision_grids)
+            throw usage_error("lazy_grids cannot be combined with single_precision_grids");
         sz max_modes_sz = static_cast<sz>(num_modes);
 
         boost::optional<std::string> rigid_name_opt;
@@ -652,6 +1027,22 @@ Thank you!\n";
         if(vm.count("flex"))
             flex_name_opt = flex_name;
 
+        search_settings settings;
+        if(vm.count("grid_cache"))
+            settings.grid_cache_dir = grid_cache_dir;
+        settings.single_precision_grids = single_precision_grids;
+        settings.interleaved_grids = interleaved_grids;
+        settings.lazy_grids = lazy_grids;
+        if(compact_tables)
+            settings.compact_table_factor = compact_table_factor;
+        settings.local_optimizer = local_optimizer;
+        settings.lbfgs_history = static_cast<sz>(lbfgs_history);
+        settings.chain_split = static_cast<sz>(chain_split);
+        settings.stagnation_steps = static_cast<sz>(stagnation_steps);
+        settings.replicas = static_cast<sz>(replicas);
+        settings.max_temperature = replica_max_temperature;
+        settings.exchange_steps = static_cast<sz>(exchange_steps);
+
         if(vm.count("flex") && !vm.count("receptor"))
             throw usage_error("Flexible side chains are not allowed without the rest of the receptor"); // that's the only way parsing works, actually
 
@@ -723,7 +1114,7 @@ Thank you!\n";
         }
         if(cpu < 1)
             cpu = 1;
-        if(verbosity > 1 && exhaustiveness < cpu)
+        if(verbosity > 1 && exhaustiveness * chain_split * ligands_in_flight < cpu)
             log << "WARNING: at low exhaustiveness, it may be impossible to utilize all CPUs\n";
 
 
@@ -747,12 +1138,28 @@ Thank you!\n";
 
             done(verbosity,log);
 
+            printf("\nBuilding receptor grids for the batch...\n");
+            std::cout.flush();
+            batch_session session(templateModel, gd, weights, !(score_only || randomize_only || local_only), settings, cpu, log); // before the fork loop, so that children inherit the grids
+            if(use_fork_parallelism) {
+                const sz shared = session.share_grids();
+                if(shared > 0)
+                    printf("Sharing %.1f MB of grids with the forked processes\n", shared / (1024.0 * 1024.0));
+            }
+
             std::ifstream infile(job_file.c_str());
+            if(ligands_in_flight > 1) { // reads the whole job file; the loop below then only finds its end
+                concurrent_batch batch(session, templateModel, infile, a, batch_out,
+                                       score_only, local_only, randomize_only, exhaustiveness, cpu, verbosity, max_modes_sz, energy_range, log);
+                batch.run(static_cast<sz>(ligands_in_flight));
+            }
 
             int i = 0;
             int maxNbrOfFork = forknbr;
             std::queue<int> pid_queue;
             bool is_a_child_process = false;
+            if(use_fork_parallelism)
+                thread_pool::shutdown_process_wide(); // its workers would not be copied by fork
 
 
             while(true)
@@ -821,16 +1228,10 @@ Thank you!\n";
 
                     std::string outname = batch_out + "/" + base_filename + ".out.pdbqt";
                     std::cout << "output : " << outname << std::endl;
-                    boost::optional<model> ref;
 
-
-
-                    main_procedure(*m, ref,
-                                   outname.c_str(),
-                                   score_only, local_only, randomize_only, false, // no_cache == false
-                                   gd, exhaustiveness,
-                                   weights,
-                                   cpu, seed, verbosity, max_modes_sz, energy_range, log);
+                    session.dock(*m, outname,
+                                 score_only, local_only, randomize_only,
+                                 exhaustiveness, cpu, seed, verbosity, max_modes_sz, energy_range, log);
                 } catch(...)
                 {
                     printf("\nException caught, moving on to next ligand...\n");
@@ -924,6 +1325,10 @@ Thank you!\n";
 
             // Define stuff common to governor and worker
 
+            // The worker ranks of each node, which share one copy of the grids (the governor is not part of any)
+            MPI_Comm node_comm;
+            MPI_Comm_split_type(MPI_COMM_WORLD, is_mpi_worker ? MPI_COMM_TYPE_SHARED : MPI_UNDEFINED, rank, MPI_INFO_NULL, &node_comm);
+
 
             const int send_data_tag = 13; // Arbitrary value to tag message
             const int want_data_tag = 13; // Arbitrary value to tag message
@@ -1016,7 +1421,16 @@ Thank you!\n";
             {
                 printf("\nInitializing worker rank %i...\n",rank);
 
+                int node_rank;
+                MPI_Comm_rank(node_comm, &node_rank);
+                const bool cache_needed = !(score_only || randomize_only || local_only);
+                const bool share_grids = cache_needed && !lazy_grids; // lazy grids are filled per rank as its search reaches them
+
                 model templateModel = parse_bundle_partial_screening(*rigid_name_opt); // Create a model without appended ligand.
+                batch_session session(templateModel, gd, weights, cache_needed && (!share_grids || node_rank == 0), settings, cpu, log);
+                MPI_Win node_window = MPI_WIN_NULL;
+                if(share_grids)
+                    node_window = share_node_grids(session, node_comm, interleaved_grids);
 
                 std::ifstream infile(job_file.c_str());
                 if(infile.is_open() == false)
@@ -1065,14 +1479,10 @@ Thank you!\n";
                         m->append(parse_ligand_pdbqt(make_path(std::vector<std::string>(1, path)[0])));
 
                         std::string outname = batch_out + "/" + base_filename + ".out.pdbqt";
-                        boost::optional<model> ref;
-
-                        main_procedure(*m, ref,
-                                       outname.c_str(),
-                                       score_only, local_only, randomize_only, false, // no_cache == false
-                                       gd, exhaustiveness,
-                                       weights,
-                                       cpu, recv[0], verbosity, max_modes_sz, energy_range, log);
+
+                        session.dock(*m, outname,
+                                     score_only, local_only, randomize_only,
+                                     exhaustiveness, cpu, recv[0], verbosity, max_modes_sz, energy_range, log);
                     } catch(...)
                     {
                         printf("\nException caught, moving on to next ligand...\n");
@@ -1084,6 +1494,9 @@ Thank you!\n";
                     delete m;
                 } // Data bound main lopp
 
+                if(node_window != MPI_WIN_NULL)
+                    MPI_Win_free(&node_window);
+                MPI_Comm_free(&node_comm);
 
 
             } //  if(is_mpi_worker == true)
@@ -1117,7 +1530,7 @@ Thank you!\n";
                            out_name,
                            score_only, local_only, randomize_only, false, // no_cache == false
                            gd, exhaustiveness,
-                           weights,
+                           weights, settings,
                            cpu, seed, verbosity, max_modes_sz, energy_range, log);
 
         }